@@ -0,0 +1,33 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sfbench.h"
+
+int bench_run_isolated(int (*fn)(const void *arg, void *out), const void *arg,
+                       void *out, size_t size) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        int ok = fn(arg, out) == 0;
+        ssize_t n = write(fds[1], out, size);
+        _exit(ok && n == (ssize_t)size ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(fds[1]);
+    ssize_t n = read(fds[0], out, size);
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (n != (ssize_t)size || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+/**
+ * Helpers shared by the benchmarks in this directory.
+ */
+#ifndef SFBENCH_H
+#define SFBENCH_H
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Runs fn(arg, out) in a forked child, so that every run starts from a fresh
+ * heap and none of them sees what an earlier one left behind, and copies the
+ * size bytes fn stored in out back into the caller's out through a pipe.
+ *
+ * @return 0 if fn returned 0 and its result arrived whole, -1 otherwise.
+ */
+int bench_run_isolated(int (*fn)(const void *arg, void *out), const void *arg,
+                       void *out, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
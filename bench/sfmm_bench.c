@@ -0,0 +1,546 @@
+/**
+ * Multi-threaded scalability benchmark.
+ *
+ * Runs the usual allocator stress patterns at 1..N threads against sfmm and
+ * against the C library's malloc, and reports throughput, resident memory
+ * growth per thread and the speedup curve of each allocator.
+ *
+ * The allocator does not synchronize on its own, so the sfmm entry points are
+ * wrapped in a single mutex here; "sfmm-cpu" takes it only when the per-CPU
+ * caches (src/sfcpucache.c) miss.  Built with LOCKS=fine, "sfmm-fine" calls
+ * sf_malloc and sf_free directly and relies on their per-list locks, and the
+ * "mixed" pattern spreads every thread over all size classes to show where a
+ * single mutex serializes threads that never touch the same list.
+ *
+ * Every (pattern, allocator, threads) configuration runs in a forked child so
+ * that each one starts from a fresh heap and its RSS delta is not polluted by
+ * the previous runs.  For sfmm the child also reports sf_utilization(), and -P
+ * selects the placement policy it runs with.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+#include "sfbench.h"
+
+#define MAX_THREADS 64
+#define CHURN_SLOTS 64
+#define RING_SLOTS 1024
+#define LARSON_SLOTS 256
+#define LARSON_ROUNDS 16
+#define SHBENCH_BATCH 100
+#define MIXED_SLOTS 256
+
+typedef struct allocator {
+    const char *name;
+    void *(*malloc_fn)(size_t);
+    void (*free_fn)(void *);
+} allocator;
+
+typedef struct ring {
+    void *slots[RING_SLOTS];
+    unsigned long head;     // Written by the consumer only.
+    unsigned long tail;     // Written by the producer only.
+} ring;
+
+typedef struct worker {
+    int id;
+    int nthreads;
+    long ops;               // Operations requested per thread.
+    long done;              // Operations actually performed (malloc + free).
+    double start, end;      // When this thread started and finished its pattern.
+    unsigned long long rng;
+    const allocator *alloc;
+} worker;
+
+typedef struct pattern {
+    const char *name;
+    void (*run)(worker *w);
+} pattern;
+
+typedef struct result {
+    double seconds;
+    long ops;
+    long rss_growth_kb;
+    double utilization;     // sf_utilization() at the end, or -1 for other allocators.
+} result;
+
+static pthread_mutex_t sf_big_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t start_barrier;
+static pthread_barrier_t round_barrier;
+static ring rings[MAX_THREADS];
+static void **larson_slots[MAX_THREADS];
+
+static const struct {
+    const char *name;
+    int policy;
+} placements[] = {
+    { "first", SF_FIRST_FIT },
+    { "best", SF_BEST_FIT },
+    { "address", SF_ADDRESS_FIT },
+};
+#define NUM_PLACEMENTS ((int)(sizeof(placements) / sizeof(placements[0])))
+static int placement = SF_FIRST_FIT;
+
+static void *sf_locked_malloc(size_t size) {
+    pthread_mutex_lock(&sf_big_lock);
+    void *p = sf_malloc(size);
+    pthread_mutex_unlock(&sf_big_lock);
+    return p;
+}
+
+static void sf_locked_free(void *p) {
+    pthread_mutex_lock(&sf_big_lock);
+    sf_free(p);
+    pthread_mutex_unlock(&sf_big_lock);
+}
+
+/*
+ * The same lock, taken only when the per-CPU cache of the current CPU cannot
+ * serve the request.
+ */
+static void *sf_cpu_malloc(size_t size) {
+    void *p = sf_cpu_cache_alloc(size);
+    if (p == NULL) {
+        pthread_mutex_lock(&sf_big_lock);
+        p = sf_cpu_cache_refill(size);
+        pthread_mutex_unlock(&sf_big_lock);
+    }
+    return p;
+}
+
+static void sf_cpu_free(void *p) {
+    if (!sf_cpu_cache_free(p)) {
+        pthread_mutex_lock(&sf_big_lock);
+        sf_cpu_cache_drain(p);
+        pthread_mutex_unlock(&sf_big_lock);
+    }
+}
+
+#ifdef SF_FINE_LOCKS
+static void *sf_fine_malloc(size_t size) {
+    return sf_malloc(size);
+}
+
+static void sf_fine_free(void *p) {
+    sf_free(p);
+}
+#endif
+
+static void *libc_malloc(size_t size) {
+    return malloc(size);
+}
+
+static void libc_free(void *p) {
+    free(p);
+}
+
+static const allocator allocators[] = {
+    { "sfmm", sf_locked_malloc, sf_locked_free },
+    { "sfmm-cpu", sf_cpu_malloc, sf_cpu_free },
+#ifdef SF_FINE_LOCKS
+    { "sfmm-fine", sf_fine_malloc, sf_fine_free },
+#endif
+    { "glibc", libc_malloc, libc_free },
+};
+#define NUM_ALLOCATORS ((int)(sizeof(allocators) / sizeof(allocators[0])))
+
+/*
+    Helpers
+*/
+
+static unsigned long long next_rand(worker *w) {
+    // xorshift64*
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 2685821657736338717ULL;
+}
+
+static size_t rand_size(worker *w, size_t min, size_t max) {
+    return min + (size_t)(next_rand(w) % (max - min + 1));
+}
+
+static void *bench_malloc(worker *w, size_t size) {
+    char *p = w->alloc->malloc_fn(size);
+    if (p == NULL) {
+        fprintf(stderr, "%s: allocation of %zu bytes failed\n", w->alloc->name, size);
+        exit(EXIT_FAILURE);
+    }
+    // Touch the block so that the page is really committed
+    p[0] = (char)size;
+    w->done++;
+    return p;
+}
+
+static void bench_free(worker *w, void *p) {
+    w->alloc->free_fn(p);
+    w->done++;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long rss_kb() {
+    long size = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+    Patterns
+*/
+
+/**
+ * Thread-local churn: every thread randomly allocates and frees small blocks
+ * in a private window, so nothing is ever shared between threads.
+ */
+static void run_churn(worker *w) {
+    void *slots[CHURN_SLOTS] = { NULL };
+
+    while (w->done < w->ops) {
+        int i = next_rand(w) % CHURN_SLOTS;
+        if (slots[i]) {
+            bench_free(w, slots[i]);
+            slots[i] = NULL;
+        } else {
+            slots[i] = bench_malloc(w, rand_size(w, 8, 256));
+        }
+    }
+    for (int i = 0; i < CHURN_SLOTS; i++) {
+        if (slots[i]) {
+            bench_free(w, slots[i]);
+        }
+    }
+}
+
+/**
+ * Producer/consumer: every thread allocates into its own ring and frees what
+ * its predecessor produced, so each block is freed by a different thread than
+ * the one that allocated it (except in the single-threaded run).
+ */
+static void run_prodcons(worker *w) {
+    ring *out = &rings[w->id];
+    ring *in = &rings[(w->id + w->nthreads - 1) % w->nthreads];
+    long target = w->ops / 2, produced = 0, consumed = 0;
+
+    while (produced < target || consumed < target) {
+        long progress = produced + consumed;
+        for (int i = 0; i < 32 && produced < target; i++) {
+            unsigned long head = __atomic_load_n(&out->head, __ATOMIC_ACQUIRE);
+            if (out->tail - head == RING_SLOTS) {
+                break;
+            }
+            out->slots[out->tail % RING_SLOTS] = bench_malloc(w, rand_size(w, 16, 128));
+            __atomic_store_n(&out->tail, out->tail + 1, __ATOMIC_RELEASE);
+            produced++;
+        }
+        for (int i = 0; i < 32 && consumed < target; i++) {
+            unsigned long tail = __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE);
+            if (in->head == tail) {
+                break;
+            }
+            bench_free(w, in->slots[in->head % RING_SLOTS]);
+            __atomic_store_n(&in->head, in->head + 1, __ATOMIC_RELEASE);
+            consumed++;
+        }
+        if (produced + consumed == progress) {
+            // Ring full or empty; let the other side run
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * Larson: every thread keeps a set of live blocks of random sizes and keeps
+ * replacing random ones.  After each round the sets are handed to the next
+ * thread, which then frees blocks it did not allocate.
+ */
+static void run_larson(worker *w) {
+    long per_round = w->ops / (2 * LARSON_ROUNDS);
+
+    for (int i = 0; i < LARSON_SLOTS; i++) {
+        larson_slots[w->id][i] = bench_malloc(w, rand_size(w, 16, 512));
+    }
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        void **slots = larson_slots[(w->id + round) % w->nthreads];
+        for (long n = 0; n < per_round; n++) {
+            int i = next_rand(w) % LARSON_SLOTS;
+            bench_free(w, slots[i]);
+            slots[i] = bench_malloc(w, rand_size(w, 16, 512));
+        }
+        pthread_barrier_wait(&round_barrier);
+    }
+    for (int i = 0; i < LARSON_SLOTS; i++) {
+        bench_free(w, larson_slots[w->id][i]);
+    }
+}
+
+/**
+ * shbench-style mix: batches of mostly small blocks with an occasional large
+ * one, freed in an interleaved order so that holes get refilled before the
+ * batch is released.
+ */
+static size_t shbench_size(worker *w) {
+    int r = next_rand(w) % 100;
+    if (r < 70) {
+        return rand_size(w, 8, 64);
+    }
+    if (r < 95) {
+        return rand_size(w, 65, 512);
+    }
+    return rand_size(w, 513, 4096);
+}
+
+static void run_shbench(worker *w) {
+    void *batch[SHBENCH_BATCH];
+
+    while (w->done < w->ops) {
+        for (int i = 0; i < SHBENCH_BATCH; i++) {
+            batch[i] = bench_malloc(w, shbench_size(w));
+        }
+        for (int i = 0; i < SHBENCH_BATCH; i += 2) {
+            bench_free(w, batch[i]);
+        }
+        for (int i = 0; i < SHBENCH_BATCH; i += 2) {
+            batch[i] = bench_malloc(w, shbench_size(w));
+        }
+        for (int i = SHBENCH_BATCH - 1; i >= 0; i--) {
+            bench_free(w, batch[i]);
+        }
+    }
+}
+
+/**
+ * Mixed sizes: thread-local churn like the first pattern, but with sizes
+ * spread evenly over powers of two from 16 bytes to 16 KiB, so that the
+ * threads allocate from every quick list and most free lists at once.
+ */
+static void run_mixed(worker *w) {
+    void *slots[MIXED_SLOTS] = { NULL };
+
+    while (w->done < w->ops) {
+        int i = next_rand(w) % MIXED_SLOTS;
+        if (slots[i]) {
+            bench_free(w, slots[i]);
+            slots[i] = NULL;
+        } else {
+            size_t min = (size_t)16 << (next_rand(w) % 10);
+            slots[i] = bench_malloc(w, rand_size(w, min, 2 * min - 1));
+        }
+    }
+    for (int i = 0; i < MIXED_SLOTS; i++) {
+        if (slots[i]) {
+            bench_free(w, slots[i]);
+        }
+    }
+}
+
+static const pattern patterns[] = {
+    { "churn", run_churn },
+    { "prodcons", run_prodcons },
+    { "larson", run_larson },
+    { "shbench", run_shbench },
+    { "mixed", run_mixed },
+};
+#define NUM_PATTERNS ((int)(sizeof(patterns) / sizeof(patterns[0])))
+
+/*
+    Driver
+*/
+
+static const pattern *current_pattern;
+
+static void *thread_main(void *arg) {
+    worker *w = arg;
+    pthread_barrier_wait(&start_barrier);
+    w->start = now();
+    current_pattern->run(w);
+    w->end = now();
+    return NULL;
+}
+
+static result run_one(const pattern *pat, const allocator *alloc, int nthreads, long ops) {
+    pthread_t threads[MAX_THREADS];
+    worker workers[MAX_THREADS];
+    result res = { 0, 0, 0, -1 };
+    int is_sfmm = strncmp(alloc->name, "sfmm", 4) == 0;
+
+    if (is_sfmm) {
+        sf_heap_set_placement(NULL, placement, 0);
+    }
+
+    current_pattern = pat;
+    memset(rings, 0, sizeof(rings));
+    for (int i = 0; i < nthreads; i++) {
+        larson_slots[i] = calloc(LARSON_SLOTS, sizeof(void *));
+    }
+    pthread_barrier_init(&start_barrier, NULL, nthreads);
+    pthread_barrier_init(&round_barrier, NULL, nthreads);
+
+    long rss_before = rss_kb();
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].id = i;
+        workers[i].nthreads = nthreads;
+        workers[i].ops = ops;
+        workers[i].done = 0;
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        workers[i].alloc = alloc;
+        pthread_create(&threads[i], NULL, thread_main, &workers[i]);
+    }
+    double start = 0, end = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+        res.ops += workers[i].done;
+        if (i == 0 || workers[i].start < start) {
+            start = workers[i].start;
+        }
+        if (workers[i].end > end) {
+            end = workers[i].end;
+        }
+    }
+    res.seconds = end - start;
+    res.rss_growth_kb = rss_kb() - rss_before;
+    if (is_sfmm) {
+        res.utilization = sf_utilization();
+    }
+    return res;
+}
+
+typedef struct run_args {
+    const pattern *pat;
+    const allocator *alloc;
+    int nthreads;
+    long ops;
+} run_args;
+
+static int run_child(const void *arg, void *out) {
+    const run_args *args = arg;
+    *(result *)out = run_one(args->pat, args->alloc, args->nthreads, args->ops);
+    return 0;
+}
+
+/**
+ * Runs a (pattern, allocator, threads) configuration on a fresh heap, so that the
+ * fragmentation and RSS of earlier runs do not carry over.
+ */
+static int run_isolated(const pattern *pat, const allocator *alloc, int nthreads, long ops,
+                        result *res) {
+    run_args args = { pat, alloc, nthreads, ops };
+    return bench_run_isolated(run_child, &args, res, sizeof(*res));
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-t max_threads] [-n ops_per_thread] [-p pattern] [-a allocator] [-P placement]\n"
+            "  patterns:   churn, prodcons, larson, shbench, mixed (default: all)\n"
+            "  allocators: sfmm, sfmm-cpu (per-CPU caches), sfmm-fine (LOCKS=fine builds), glibc\n"
+            "              (default: all)\n"
+            "  placements: first, best, address (default: first)\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long ops = 200000;
+    const char *only_pattern = NULL, *only_alloc = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:n:p:a:P:h")) != -1) {
+        switch (opt) {
+        case 't': max_threads = atoi(optarg); break;
+        case 'n': ops = atol(optarg); break;
+        case 'p': only_pattern = optarg; break;
+        case 'a': only_alloc = optarg; break;
+        case 'P':
+            placement = -1;
+            for (int i = 0; i < NUM_PLACEMENTS; i++) {
+                if (strcmp(optarg, placements[i].name) == 0) {
+                    placement = placements[i].policy;
+                }
+            }
+            if (placement < 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+    if (max_threads > MAX_THREADS) {
+        max_threads = MAX_THREADS;
+    }
+
+    // Thread counts: powers of two up to the maximum, plus the maximum itself
+    int counts[MAX_THREADS], ncounts = 0;
+    for (int t = 1; t < max_threads; t *= 2) {
+        counts[ncounts++] = t;
+    }
+    counts[ncounts++] = max_threads;
+
+    printf("%-9s %-8s %7s %10s %8s %9s %6s %14s\n",
+           "pattern", "alloc", "threads", "Mops/s", "speedup", "vs-glibc", "util", "RSS/thread KiB");
+
+    for (int p = 0; p < NUM_PATTERNS; p++) {
+        if (only_pattern && strcmp(only_pattern, patterns[p].name) != 0) {
+            continue;
+        }
+        double base[NUM_ALLOCATORS] = { 0 };
+        double glibc_at[MAX_THREADS + 1] = { 0 };
+
+        // glibc first so that the sfmm rows can be compared against it
+        for (int a = NUM_ALLOCATORS - 1; a >= 0; a--) {
+            if (only_alloc && strcmp(only_alloc, allocators[a].name) != 0) {
+                continue;
+            }
+            for (int c = 0; c < ncounts; c++) {
+                int t = counts[c];
+                result r;
+                if (run_isolated(&patterns[p], &allocators[a], t, ops, &r) != 0) {
+                    printf("%-9s %-8s %7d %10s\n", patterns[p].name, allocators[a].name, t, "failed");
+                    continue;
+                }
+                double mops = r.ops / r.seconds / 1e6;
+                if (c == 0) {
+                    base[a] = mops;
+                }
+                if (strcmp(allocators[a].name, "glibc") == 0) {
+                    glibc_at[t] = mops;
+                }
+                printf("%-9s %-8s %7d %10.2f %8.2f ", patterns[p].name, allocators[a].name, t,
+                       mops, base[a] > 0 ? mops / base[a] : 0.0);
+                if (glibc_at[t] > 0) {
+                    printf("%9.2f ", mops / glibc_at[t]);
+                } else {
+                    printf("%9s ", "-");
+                }
+                if (r.utilization >= 0) {
+                    printf("%6.3f ", r.utilization);
+                } else {
+                    printf("%6s ", "-");
+                }
+                printf("%14ld\n", r.rss_growth_kb / t);
+                fflush(stdout);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,188 @@
+/**
+ * Cache-coloring benchmark.
+ *
+ * Allocates a set of large buffers whose blocks are a multiple of a page, so
+ * that without coloring every buffer starts at the same offset within a page
+ * and the same lines of all of them map to the same cache sets.  It then
+ * sweeps the first few lines of every buffer, round-robin, as a worker
+ * touching several buffers at once would.  The lines swept fit in L1 many
+ * times over, so what misses is a conflict miss: more buffers share a set than
+ * the cache has ways.
+ *
+ * Each run, uncolored and then colored with sf_heap_set_coloring, happens in
+ * a forked child so that it starts from a fresh heap.  L1D read misses are
+ * counted with perf_event_open where the kernel allows it; the time per
+ * access is reported either way.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+#include "sfbench.h"
+
+#define MAX_BUFFERS 256
+#define LINE 64
+
+typedef struct config {
+    int buffers;
+    size_t size;                // Payload of each buffer; its block is size + 16 bytes.
+    size_t touched;             // Bytes swept at the start of each buffer.
+    long rounds;
+    int colors;
+} config;
+
+typedef struct result {
+    double ns_per_access;
+    double misses_per_access;   // Negative if the counter is not available.
+    int distinct_offsets;       // Different buffer start offsets within a page.
+} result;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Opens a counter of L1D read misses for this thread, or returns -1.
+ */
+static int open_l1d_misses(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static result run_one(const config *cfg) {
+    result res = { 0, -1, 0 };
+    if (cfg->colors > 1) {
+        sf_heap_set_coloring(NULL, cfg->colors, 0);
+    }
+    volatile uint64_t *buf[MAX_BUFFERS];
+    int seen[PAGE_SZ / LINE] = { 0 };
+    for (int b = 0; b < cfg->buffers; b++) {
+        buf[b] = sf_malloc(cfg->size);
+        if (buf[b] == NULL) {
+            return res;
+        }
+        memset((void *)buf[b], b, cfg->touched);
+        int offset = (int)(((uintptr_t)buf[b] % PAGE_SZ) / LINE);
+        res.distinct_offsets += !seen[offset];
+        seen[offset] = 1;
+    }
+
+    // Chain the lines in sweep order, one line of every buffer before the next line of
+    // any, so that each load waits for the previous one and a miss costs its full latency
+    size_t lines = cfg->touched / LINE;
+    volatile uint64_t *prev = NULL, *first = NULL;
+    for (size_t l = 0; l < lines; l++) {
+        for (int b = 0; b < cfg->buffers; b++) {
+            volatile uint64_t *p = buf[b] + l * (LINE / sizeof(uint64_t));
+            if (prev != NULL) {
+                *prev = (uintptr_t)p;
+            } else {
+                first = p;
+            }
+            prev = p;
+        }
+    }
+    *prev = (uintptr_t)first;
+
+    long steps = cfg->rounds * (long)lines * cfg->buffers;
+    volatile uint64_t *p = first;
+    int fd = open_l1d_misses();
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    double start = now_ns();
+    for (long i = 0; i < steps; i++) {
+        p = (volatile uint64_t *)(uintptr_t)*p;
+    }
+    double elapsed = now_ns() - start;
+    double accesses = (double)steps;
+    if (fd >= 0) {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t misses;
+        if (read(fd, &misses, sizeof(misses)) == sizeof(misses)) {
+            res.misses_per_access = misses / accesses;
+        }
+        close(fd);
+    }
+    res.ns_per_access = elapsed / accesses;
+    return res;
+}
+
+/**
+ * Takes the buffers of one run from a fresh heap, so that the colored run does not
+ * reuse the blocks the uncolored one laid out.  A run that measured nothing fails.
+ */
+static int run_child(const void *arg, void *out) {
+    result *res = out;
+    *res = run_one(arg);
+    return res->ns_per_access > 0 ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-b buffers] [-s size] [-w touched_bytes] [-r rounds] [-c colors]\n"
+            "  defaults: 32 buffers of 16368 bytes (16 KiB blocks), 512 bytes swept in each,\n"
+            "            200000 rounds, 64 colors\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    config cfg = { 32, 16 * 1024 - 16, 512, 200000, 64 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:s:w:r:c:h")) != -1) {
+        switch (opt) {
+        case 'b': cfg.buffers = atoi(optarg); break;
+        case 's': cfg.size = strtoul(optarg, NULL, 10); break;
+        case 'w': cfg.touched = strtoul(optarg, NULL, 10); break;
+        case 'r': cfg.rounds = atol(optarg); break;
+        case 'c': cfg.colors = atoi(optarg); break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (cfg.buffers < 1 || cfg.buffers > MAX_BUFFERS || cfg.touched < LINE || cfg.touched > cfg.size
+        || cfg.rounds < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%d buffers of %zu bytes, %zu bytes swept in each (%zu KiB in all)\n",
+           cfg.buffers, cfg.size, cfg.touched, cfg.buffers * cfg.touched / 1024);
+    printf("%-10s %8s %12s %16s\n", "mode", "offsets", "ns/access", "L1D miss/access");
+    int colors = cfg.colors;
+    for (int pass = 0; pass < 2; pass++) {
+        cfg.colors = pass ? colors : 0;
+        result r;
+        if (bench_run_isolated(run_child, &cfg, &r, sizeof(r)) != 0) {
+            fprintf(stderr, "run failed\n");
+            return EXIT_FAILURE;
+        }
+        char label[32];
+        snprintf(label, sizeof(label), pass ? "colors=%d" : "uncolored", cfg.colors);
+        if (r.misses_per_access >= 0) {
+            printf("%-10s %8d %12.2f %16.3f\n", label, r.distinct_offsets, r.ns_per_access,
+                   r.misses_per_access);
+        } else {
+            printf("%-10s %8d %12.2f %16s\n", label, r.distinct_offsets, r.ns_per_access, "n/a");
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,205 @@
+/**
+ * STL container benchmark for the C++ adapters in sfmm_allocator.hpp.
+ *
+ * Runs the same workloads on std::vector, std::unordered_map and std::map with
+ * std::allocator (glibc), sfmm::allocator, sfmm::heap_allocator on a private
+ * heap, and the pmr containers over sfmm::memory_resource:
+ *
+ *   vector          grow many vectors one push_back at a time, then free them
+ *   unordered_map   insert n keys, look each up, erase half, insert them again
+ *   map             the same on a red-black tree
+ *
+ * Every run happens in a forked child so that it starts from a fresh heap.
+ * The time per element operation is reported, with a checksum that must agree
+ * across allocators.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include "sfmm_allocator.hpp"
+#include "sfbench.h"
+
+namespace {
+
+struct config {
+    long elements;
+    int rounds;
+};
+
+struct result {
+    double ns_per_op;
+    unsigned long checksum;
+};
+
+// Keys in a fixed pseudo-random order, the same for every allocator
+unsigned long key_of(long i) {
+    return (static_cast<unsigned long>(i) * 2654435761UL) % 1000003UL;
+}
+
+template <class Vector, class... Args>
+unsigned long vector_workload(const config &cfg, long *ops, Args &&...args) {
+    unsigned long sum = 0;
+    const long per_vector = 64;
+    for (int r = 0; r < cfg.rounds; r++) {
+        std::vector<Vector> all;
+        all.reserve(cfg.elements / per_vector);
+        for (long v = 0; v < cfg.elements / per_vector; v++) {
+            all.emplace_back(args...);
+            long length = 1 + key_of(v + r) % (2 * per_vector);
+            for (long i = 0; i < length; i++) {
+                all.back().push_back(key_of(i));
+            }
+            *ops += length;
+            sum += all.back().size() + all.back()[length / 2];
+        }
+    }
+    return sum;
+}
+
+template <class Map, class... Args>
+unsigned long map_workload(const config &cfg, long *ops, Args &&...args) {
+    unsigned long sum = 0;
+    for (int r = 0; r < cfg.rounds; r++) {
+        Map m(args...);
+        for (long i = 0; i < cfg.elements; i++) {
+            m[key_of(i)] = i;
+        }
+        for (long i = 0; i < cfg.elements; i++) {
+            auto it = m.find(key_of(i));
+            sum += it == m.end() ? 0 : it->second;
+        }
+        for (long i = 0; i < cfg.elements; i += 2) {
+            m.erase(key_of(i));
+        }
+        for (long i = 0; i < cfg.elements; i += 2) {
+            m.emplace(key_of(i), i);
+        }
+        *ops += 3 * cfg.elements;
+        sum += m.size();
+    }
+    return sum;
+}
+
+using key = unsigned long;
+template <class A> using vector_of = std::vector<key, A>;
+template <class A> using hash_map_of = std::unordered_map<key, long, std::hash<key>, std::equal_to<key>, A>;
+template <class A> using tree_map_of = std::map<key, long, std::less<key>, A>;
+using pair_type = std::pair<const key, long>;
+
+/**
+ * Runs one workload with one allocator; workload 0 is vector, 1 unordered_map, 2 map.
+ */
+unsigned long run_workload(const config &cfg, int workload, const char *alloc, long *ops) {
+    if (strcmp(alloc, "std") == 0) {
+        if (workload == 0) return vector_workload<vector_of<std::allocator<key>>>(cfg, ops);
+        if (workload == 1) return map_workload<hash_map_of<std::allocator<pair_type>>>(cfg, ops);
+        return map_workload<tree_map_of<std::allocator<pair_type>>>(cfg, ops);
+    }
+    if (strcmp(alloc, "sfmm") == 0) {
+        if (workload == 0) return vector_workload<vector_of<sfmm::allocator<key>>>(cfg, ops);
+        if (workload == 1) return map_workload<hash_map_of<sfmm::allocator<pair_type>>>(cfg, ops);
+        return map_workload<tree_map_of<sfmm::allocator<pair_type>>>(cfg, ops);
+    }
+    if (strcmp(alloc, "sfmm-heap") == 0) {
+        sf_heap_t *heap = sf_heap_create();
+        if (heap == nullptr) {
+            throw std::bad_alloc();
+        }
+        unsigned long sum;
+        if (workload == 0) {
+            sum = vector_workload<vector_of<sfmm::heap_allocator<key>>>(cfg, ops,
+                                                                        sfmm::heap_allocator<key>(heap));
+        } else if (workload == 1) {
+            using A = sfmm::heap_allocator<pair_type>;
+            sum = map_workload<hash_map_of<A>>(cfg, ops, 0, std::hash<key>(), std::equal_to<key>(), A(heap));
+        } else {
+            using A = sfmm::heap_allocator<pair_type>;
+            sum = map_workload<tree_map_of<A>>(cfg, ops, std::less<key>(), A(heap));
+        }
+        sf_heap_destroy(heap);
+        return sum;
+    }
+    sfmm::memory_resource resource;
+    if (workload == 0) return vector_workload<std::pmr::vector<key>>(cfg, ops, &resource);
+    if (workload == 1) return map_workload<std::pmr::unordered_map<key, long>>(cfg, ops, &resource);
+    return map_workload<std::pmr::map<key, long>>(cfg, ops, &resource);
+}
+
+struct run_args {
+    const config *cfg;
+    int workload;
+    const char *alloc;
+};
+
+/**
+ * Times one workload with one allocator; the time is per element operation.
+ */
+int run_child(const void *arg, void *out) {
+    const run_args *args = static_cast<const run_args *>(arg);
+    result *res = static_cast<result *>(out);
+    long ops = 0;
+    auto start = std::chrono::steady_clock::now();
+    res->checksum = run_workload(*args->cfg, args->workload, args->alloc, &ops);
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    res->ns_per_op = elapsed.count() / ops;
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-n elements] [-r rounds]\n"
+            "  defaults: 100000 elements, 5 rounds\n", prog);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    config cfg = { 100000, 5 };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:h")) != -1) {
+        switch (opt) {
+        case 'n': cfg.elements = atol(optarg); break;
+        case 'r': cfg.rounds = atoi(optarg); break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (cfg.elements < 128 || cfg.rounds < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    static const char *workloads[] = { "vector", "unordered_map", "map" };
+    static const char *allocs[] = { "std", "sfmm", "sfmm-heap", "pmr" };
+    printf("%ld elements, %d rounds\n", cfg.elements, cfg.rounds);
+    printf("%-14s %-10s %10s %10s\n", "workload", "allocator", "ns/op", "vs std");
+    for (int w = 0; w < 3; w++) {
+        double baseline = 0;
+        unsigned long checksum = 0;
+        for (int a = 0; a < 4; a++) {
+            result r;
+            run_args args = { &cfg, w, allocs[a] };
+            if (bench_run_isolated(run_child, &args, &r, sizeof(r)) != 0) {
+                fprintf(stderr, "%s with %s failed\n", workloads[w], allocs[a]);
+                return EXIT_FAILURE;
+            }
+            if (a == 0) {
+                baseline = r.ns_per_op;
+                checksum = r.checksum;
+            } else if (r.checksum != checksum) {
+                fprintf(stderr, "%s with %s computed a different result\n", workloads[w], allocs[a]);
+                return EXIT_FAILURE;
+            }
+            printf("%-14s %-10s %10.1f %9.2fx\n", workloads[w], allocs[a], r.ns_per_op,
+                   baseline / r.ns_per_op);
+        }
+    }
+    return EXIT_SUCCESS;
+}
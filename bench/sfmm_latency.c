@@ -0,0 +1,445 @@
+/**
+ * Tail-latency benchmark for malloc/free.
+ *
+ * Every individual sf_malloc and sf_free call is timed and recorded in an
+ * HDR-style (log-linear) histogram, one per operation and per free-list size
+ * class.  Averages hide the calls that consolidate quick lists, walk a long free
+ * list or grow the heap a page at a time; the p99/p99.9/max columns do not.
+ *
+ * Timestamps come from the TSC on x86 (calibrated against CLOCK_MONOTONIC)
+ * or from clock_gettime elsewhere, selectable with -c.
+ *
+ * sfmm-async frees large blocks through sf_async_free_start's background
+ * thread.  Its calls take a mutex that the thread also takes, as a program
+ * sharing the heap would; the baseline for it is sfmm-locked.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+/*
+ * Histogram layout: values below 2^HIST_SUB_BITS are counted exactly, larger
+ * values share a bucket with everything that has the same leading
+ * HIST_SUB_BITS bits, which keeps the relative error under 2^-(HIST_SUB_BITS-1).
+ */
+#define HIST_SUB_BITS 6
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+#define HIST_BUCKETS (HIST_SUB_COUNT + (64 - HIST_SUB_BITS) * HIST_HALF_COUNT)
+
+#define NUM_CLASSES NUM_FREE_LISTS
+#define MIN_BLOCK 32
+
+typedef struct histogram {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;
+    unsigned long long max;
+} histogram;
+
+typedef struct allocator {
+    const char *name;
+    void *(*malloc_fn)(size_t);
+    void (*free_fn)(void *);
+    void (*setup_fn)(void);         // Run before the workload, if set.
+} allocator;
+
+typedef struct config {
+    const char *workload;
+    long ops;
+    long live;
+    size_t min_size;
+    size_t max_size;
+} config;
+
+enum { OP_MALLOC, OP_FREE, NUM_OPS };
+static const char *op_names[NUM_OPS] = { "malloc", "free" };
+
+/* [op][class]; the extra last class aggregates all sizes. */
+static histogram hists[NUM_OPS][NUM_CLASSES + 1];
+
+static int use_tsc = 0;
+static double ns_per_tick = 1.0;
+static unsigned long long rng = 0x9E3779B97F4A7C15ULL;
+
+static void *libc_malloc(size_t size) {
+    return malloc(size);
+}
+
+static void libc_free(void *p) {
+    free(p);
+}
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lock_heap(void *arg) {
+    pthread_mutex_lock(&heap_lock);
+}
+
+static void unlock_heap(void *arg) {
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static void *locked_malloc(size_t size) {
+    lock_heap(NULL);
+    void *p = sf_malloc(size);
+    unlock_heap(NULL);
+    return p;
+}
+
+static void locked_free(void *p) {
+    lock_heap(NULL);
+    sf_free(p);
+    unlock_heap(NULL);
+}
+
+static void async_setup(void) {
+    if (sf_async_free_start(0, lock_heap, unlock_heap, NULL) != 0) {
+        fprintf(stderr, "sfmm-async: cannot start the background thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static const allocator allocators[] = {
+    { "sfmm", sf_malloc, sf_free, NULL },
+    { "sfmm-locked", locked_malloc, locked_free, NULL },
+    { "sfmm-async", locked_malloc, locked_free, async_setup },
+    { "glibc", libc_malloc, libc_free, NULL },
+};
+#define NUM_ALLOCATORS ((int)(sizeof(allocators) / sizeof(allocators[0])))
+
+/*
+    Clock
+*/
+
+static unsigned long long clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static inline unsigned long long read_tsc() {
+    unsigned int lo, hi;
+    __asm__ __volatile__("lfence\n\trdtsc" : "=a"(lo), "=d"(hi) :: "memory");
+    return ((unsigned long long)hi << 32) | lo;
+}
+#define HAVE_TSC 1
+#else
+static inline unsigned long long read_tsc() {
+    return 0;
+}
+#define HAVE_TSC 0
+#endif
+
+static inline unsigned long long ticks() {
+    return use_tsc ? read_tsc() : clock_ns();
+}
+
+static void calibrate_tsc() {
+    unsigned long long c0 = clock_ns(), t0 = read_tsc();
+    while (clock_ns() - c0 < 20000000ULL) {
+        // Spin for 20ms
+    }
+    unsigned long long c1 = clock_ns(), t1 = read_tsc();
+    ns_per_tick = (double)(c1 - c0) / (double)(t1 - t0);
+}
+
+/*
+    Histogram
+*/
+
+static int hist_index(unsigned long long v) {
+    if (v < HIST_SUB_COUNT) {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - HIST_SUB_BITS + 1;
+    int top = (int)(v >> shift);    // in [HIST_HALF_COUNT, HIST_SUB_COUNT)
+    return HIST_SUB_COUNT + (msb - HIST_SUB_BITS) * HIST_HALF_COUNT + (top - HIST_HALF_COUNT);
+}
+
+/* Largest value that falls into bucket i. */
+static unsigned long long hist_value(int i) {
+    if (i < HIST_SUB_COUNT) {
+        return i;
+    }
+    int msb = (i - HIST_SUB_COUNT) / HIST_HALF_COUNT + HIST_SUB_BITS;
+    int top = (i - HIST_SUB_COUNT) % HIST_HALF_COUNT + HIST_HALF_COUNT;
+    int shift = msb - HIST_SUB_BITS + 1;
+    return (((unsigned long long)top + 1) << shift) - 1;
+}
+
+static void hist_record(histogram *h, unsigned long long v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+static unsigned long long hist_percentile(const histogram *h, double p) {
+    unsigned long rank = (unsigned long)(p * h->total + 0.5);
+    unsigned long seen = 0;
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            unsigned long long v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*
+    Workloads
+*/
+
+static unsigned long long next_rand() {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 2685821657736338717ULL;
+}
+
+static size_t rand_size(const config *cfg) {
+    return cfg->min_size + (size_t)(next_rand() % (cfg->max_size - cfg->min_size + 1));
+}
+
+/* Same rounding as the allocator, then the free-list class of the result. */
+static int size_class(size_t size) {
+    size_t block = size + 16 < MIN_BLOCK ? MIN_BLOCK : (size + 16 + 15) & ~(size_t)15;
+    int index = 0;
+    for (size_t limit = MIN_BLOCK; block > limit && index < NUM_CLASSES - 1; limit *= 2) {
+        index++;
+    }
+    return index;
+}
+
+static void record(int op, int class, unsigned long long t) {
+    hist_record(&hists[op][class], t);
+    hist_record(&hists[op][NUM_CLASSES], t);
+}
+
+static void *timed_malloc(const allocator *a, size_t size, int *class) {
+    unsigned long long t0 = ticks();
+    void *p = a->malloc_fn(size);
+    unsigned long long t1 = ticks();
+    if (p == NULL) {
+        fprintf(stderr, "%s: allocation of %zu bytes failed\n", a->name, size);
+        exit(EXIT_FAILURE);
+    }
+    *class = size_class(size);
+    record(OP_MALLOC, *class, t1 - t0);
+    return p;
+}
+
+static void timed_free(const allocator *a, void *p, int class) {
+    unsigned long long t0 = ticks();
+    a->free_fn(p);
+    unsigned long long t1 = ticks();
+    record(OP_FREE, class, t1 - t0);
+}
+
+/**
+ * random: a live set of cfg->live slots where each step frees an occupied
+ * slot or fills an empty one with a block of random size.
+ */
+static void run_random(const allocator *a, const config *cfg) {
+    void **slots = calloc(cfg->live, sizeof(void *));
+    int *classes = calloc(cfg->live, sizeof(int));
+
+    for (long n = 0; n < cfg->ops; n++) {
+        long i = next_rand() % cfg->live;
+        if (slots[i]) {
+            timed_free(a, slots[i], classes[i]);
+            slots[i] = NULL;
+        } else {
+            slots[i] = timed_malloc(a, rand_size(cfg), &classes[i]);
+        }
+    }
+    for (long i = 0; i < cfg->live; i++) {
+        if (slots[i]) {
+            timed_free(a, slots[i], classes[i]);
+        }
+    }
+    free(slots);
+    free(classes);
+}
+
+/**
+ * ramp: allocate cfg->live blocks, then free them all in random order, and
+ * repeat.  The first ramp grows the heap; the frees exercise coalescing.
+ */
+static void run_ramp(const allocator *a, const config *cfg) {
+    void **slots = calloc(cfg->live, sizeof(void *));
+    int *classes = calloc(cfg->live, sizeof(int));
+
+    for (long done = 0; done < cfg->ops; done += 2 * cfg->live) {
+        for (long i = 0; i < cfg->live; i++) {
+            slots[i] = timed_malloc(a, rand_size(cfg), &classes[i]);
+        }
+        for (long i = cfg->live - 1; i > 0; i--) {
+            long j = next_rand() % (i + 1);
+            void *p = slots[i];
+            int c = classes[i];
+            slots[i] = slots[j];
+            classes[i] = classes[j];
+            slots[j] = p;
+            classes[j] = c;
+        }
+        for (long i = 0; i < cfg->live; i++) {
+            timed_free(a, slots[i], classes[i]);
+        }
+    }
+    free(slots);
+    free(classes);
+}
+
+/**
+ * burst: allocate and free bursts of QUICK_LIST_MAX + 1 same-sized blocks.
+ * The frees pile up in a quick list, and the malloc that misses the free lists
+ * pays for consolidating them.
+ */
+static void run_burst(const allocator *a, const config *cfg) {
+    void *slots[QUICK_LIST_MAX + 1];
+    int classes[QUICK_LIST_MAX + 1];
+
+    for (long done = 0; done < cfg->ops; done += 2 * (QUICK_LIST_MAX + 1)) {
+        size_t size = rand_size(cfg);
+        for (int i = 0; i <= QUICK_LIST_MAX; i++) {
+            slots[i] = timed_malloc(a, size, &classes[i]);
+        }
+        for (int i = 0; i <= QUICK_LIST_MAX; i++) {
+            timed_free(a, slots[i], classes[i]);
+        }
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*run)(const allocator *a, const config *cfg);
+} workloads[] = {
+    { "random", run_random },
+    { "ramp", run_ramp },
+    { "burst", run_burst },
+};
+#define NUM_WORKLOADS ((int)(sizeof(workloads) / sizeof(workloads[0])))
+
+/*
+    Report
+*/
+
+static void class_label(int class, char *buf, size_t len) {
+    if (class == NUM_CLASSES) {
+        snprintf(buf, len, "all");
+    } else if (class == NUM_CLASSES - 1) {
+        snprintf(buf, len, ">%lu", (unsigned long)MIN_BLOCK << (NUM_CLASSES - 2));
+    } else {
+        snprintf(buf, len, "<=%lu", (unsigned long)MIN_BLOCK << class);
+    }
+}
+
+static void report(const allocator *a, const config *cfg, double overhead) {
+    printf("allocator %s, workload %s, %ld ops, live %ld, sizes [%zu, %zu], clock %s\n",
+           a->name, cfg->workload, cfg->ops, cfg->live, cfg->min_size, cfg->max_size,
+           use_tsc ? "tsc" : "clock_gettime");
+    printf("timer overhead %.0f ns (not subtracted)\n", overhead);
+    printf("%-7s %-8s %10s %9s %9s %9s %9s\n",
+           "op", "class", "count", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+    for (int op = 0; op < NUM_OPS; op++) {
+        for (int c = 0; c <= NUM_CLASSES; c++) {
+            const histogram *h = &hists[op][c];
+            char label[32];
+            if (h->total == 0) {
+                continue;
+            }
+            class_label(c, label, sizeof(label));
+            printf("%-7s %-8s %10lu %9.0f %9.0f %9.0f %9.0f\n", op_names[op], label, h->total,
+                   hist_percentile(h, 0.50) * ns_per_tick,
+                   hist_percentile(h, 0.99) * ns_per_tick,
+                   hist_percentile(h, 0.999) * ns_per_tick,
+                   h->max * ns_per_tick);
+        }
+    }
+}
+
+static double timer_overhead() {
+    unsigned long long best = ~0ULL;
+    for (int i = 0; i < 1000; i++) {
+        unsigned long long t0 = ticks();
+        unsigned long long t1 = ticks();
+        if (t1 - t0 < best) {
+            best = t1 - t0;
+        }
+    }
+    return best * ns_per_tick;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-w workload] [-a allocator] [-n ops] [-l live] [-s min] [-S max] [-c clock]\n"
+            "  workloads:  random, ramp, burst (default: random)\n"
+            "  allocators: sfmm, sfmm-locked, sfmm-async, glibc (default: sfmm)\n"
+            "  clock:      tsc, gettime (default: tsc where available)\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    config cfg = { "random", 1000000, 1000, 8, 1024 };
+    const char *alloc_name = "sfmm";
+    int opt;
+
+    use_tsc = HAVE_TSC;
+    while ((opt = getopt(argc, argv, "w:a:n:l:s:S:c:h")) != -1) {
+        switch (opt) {
+        case 'w': cfg.workload = optarg; break;
+        case 'a': alloc_name = optarg; break;
+        case 'n': cfg.ops = atol(optarg); break;
+        case 'l': cfg.live = atol(optarg); break;
+        case 's': cfg.min_size = strtoul(optarg, NULL, 10); break;
+        case 'S': cfg.max_size = strtoul(optarg, NULL, 10); break;
+        case 'c': use_tsc = HAVE_TSC && strcmp(optarg, "tsc") == 0; break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (cfg.live < 1 || cfg.min_size < 1 || cfg.max_size < cfg.min_size) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const allocator *a = NULL;
+    for (int i = 0; i < NUM_ALLOCATORS; i++) {
+        if (strcmp(alloc_name, allocators[i].name) == 0) {
+            a = &allocators[i];
+        }
+    }
+    int w = -1;
+    for (int i = 0; i < NUM_WORKLOADS; i++) {
+        if (strcmp(cfg.workload, workloads[i].name) == 0) {
+            w = i;
+        }
+    }
+    if (a == NULL || w < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (use_tsc) {
+        calibrate_tsc();
+    }
+    double overhead = timer_overhead();
+    if (a->setup_fn) {
+        a->setup_fn();
+    }
+    workloads[w].run(a, &cfg);
+    report(a, &cfg, overhead);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,41 @@
+#ifndef SFDUMP_H
+#define SFDUMP_H
+#include <stdint.h>
+
+/*
+ * Layout of the heap snapshots written by sf_heap_dump and read by
+ * tools/sfdump_analyze.  A snapshot is one sf_dump_header followed by
+ * header.blocks sf_dump_record entries in address order, from the first block
+ * after the prologue up to the epilogue.  Fields are in the byte order of the
+ * machine that wrote the snapshot.
+ */
+
+#define SF_DUMP_MAGIC   "SFDUMP\0\0"
+#define SF_DUMP_VERSION 1
+
+/* Block states */
+#define SF_DUMP_FREE      0     /* In a free list. */
+#define SF_DUMP_ALLOCATED 1     /* Handed out, including the segments of private heaps. */
+#define SF_DUMP_QUICK     2     /* Freed into a quick list, not yet coalesced. */
+#define SF_DUMP_TOP       3     /* The top chunk, next to the epilogue. */
+
+typedef struct sf_dump_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;       // sizeof(sf_dump_record)
+    uint64_t page_size;
+    uint64_t heap_start;        // Address of the heap's first byte; offsets are relative to it
+    uint64_t heap_size;
+    uint64_t blocks;            // Records that follow
+} sf_dump_header;
+
+typedef struct sf_dump_record {
+    uint64_t offset;            // Of the block header, from heap_start
+    uint32_t size;              // Block size, header and footer included
+    uint32_t payload;           // Bytes requested for an allocated block, 0 otherwise
+    uint8_t state;              // SF_DUMP_*
+    uint8_t size_class;         // Free list that a free block of this size goes in
+    uint8_t unused[6];
+} sf_dump_record;
+
+#endif
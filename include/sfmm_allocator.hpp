@@ -0,0 +1,170 @@
+/**
+ * C++ adapters over the allocator, for routing individual containers to it
+ * without replacing the global operator new.
+ *
+ *   sfmm::allocator<T>        a stateless STL allocator over the default heap
+ *   sfmm::heap_allocator<T>   an STL allocator bound to a heap
+ *   sfmm::memory_resource     a std::pmr::memory_resource over a heap
+ *
+ * Requests aligned beyond alignof(std::max_align_t), which sf_malloc's 16
+ * bytes already cover, go through sf_heap_memalign.  Sized deallocation is
+ * accepted everywhere; the size is not needed to free a block, whose header
+ * records it, so it is only checked against the block in debug builds.  A
+ * failed allocation throws std::bad_alloc.
+ *
+ * Like the heaps underneath them, these are not thread-safe: calls must be
+ * serialized unless the allocator was built with LOCKS=fine, and then only on
+ * the default heap.  Requires C++17.
+ */
+#ifndef SFMM_ALLOCATOR_HPP
+#define SFMM_ALLOCATOR_HPP
+#include <cassert>
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include "sfmm_ext.h"
+
+namespace sfmm {
+
+/**
+ * Allocates bytes aligned to alignment from heap, the default heap if it is null.  Zero
+ * bytes still yield a distinct block, as operator new requires.
+ */
+inline void *allocate_bytes(sf_heap_t *heap, std::size_t bytes,
+                            std::size_t alignment = alignof(std::max_align_t)) {
+    if (bytes == 0) {
+        bytes = 1;
+    }
+    void *p = alignment <= alignof(std::max_align_t) ? sf_heap_malloc(heap, bytes)
+                                                     : sf_heap_memalign(heap, alignment, bytes);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+inline void deallocate_bytes(sf_heap_t *heap, void *p, std::size_t bytes) noexcept {
+    assert(sf_malloc_usable_size(p) >= bytes);
+    (void)bytes;
+    sf_heap_free(heap, p);
+}
+
+/**
+ * A stateless allocator over the default heap.  All instances are interchangeable, so
+ * containers using it swap and move-assign in O(1).
+ */
+template <class T>
+class allocator {
+public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using is_always_equal = std::true_type;
+
+    allocator() noexcept = default;
+    template <class U>
+    allocator(const allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T *>(allocate_bytes(nullptr, n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept {
+        deallocate_bytes(nullptr, p, n * sizeof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+    return false;
+}
+
+/**
+ * An allocator bound to a heap from sf_heap_create, or to the default heap if the heap is
+ * null.  Copies share the heap; containers keep their allocator when copied, moved or
+ * swapped, so the heap must outlive every container that uses it.
+ */
+template <class T>
+class heap_allocator {
+public:
+    using value_type = T;
+
+    explicit heap_allocator(sf_heap_t *heap = nullptr) noexcept : heap_(heap) {}
+    template <class U>
+    heap_allocator(const heap_allocator<U> &other) noexcept : heap_(other.heap()) {}
+
+    sf_heap_t *heap() const noexcept { return heap_; }
+
+    T *allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T *>(allocate_bytes(heap_, n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, std::size_t n) noexcept {
+        deallocate_bytes(heap_, p, n * sizeof(T));
+    }
+
+private:
+    sf_heap_t *heap_;
+};
+
+template <class T, class U>
+bool operator==(const heap_allocator<T> &a, const heap_allocator<U> &b) noexcept {
+    return a.heap() == b.heap();
+}
+
+template <class T, class U>
+bool operator!=(const heap_allocator<T> &a, const heap_allocator<U> &b) noexcept {
+    return a.heap() != b.heap();
+}
+
+/**
+ * A memory resource over a heap, or over the default heap if the heap is null.  Two
+ * resources are equal if they use the same heap, so memory from one may be returned to
+ * the other.
+ */
+class memory_resource : public std::pmr::memory_resource {
+public:
+    explicit memory_resource(sf_heap_t *heap = nullptr) noexcept : heap_(heap) {}
+
+    sf_heap_t *heap() const noexcept { return heap_; }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        return allocate_bytes(heap_, bytes, alignment);
+    }
+
+    void do_deallocate(void *p, std::size_t bytes, std::size_t) override {
+        deallocate_bytes(heap_, p, bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        const memory_resource *r = dynamic_cast<const memory_resource *>(&other);
+        return r != nullptr && r->heap_ == heap_;
+    }
+
+private:
+    sf_heap_t *heap_;
+};
+
+/**
+ * The resource over the default heap, e.g. for std::pmr::set_default_resource.
+ */
+inline memory_resource *default_resource() noexcept {
+    static memory_resource resource;
+    return &resource;
+}
+
+} // namespace sfmm
+
+#endif
@@ -0,0 +1,485 @@
+/**
+ * Extensions to the interface in sfmm.h.
+ *
+ * sfmm.h is fixed, so everything the allocator offers beyond sf_malloc,
+ * sf_realloc and sf_free is declared here.  This header does not include
+ * sfmm.h and only declares functions, so it can also be used from C++.
+ */
+#ifndef SFMM_EXT_H
+#define SFMM_EXT_H
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Allocates a block whose payload address is a multiple of alignment.
+ *
+ * @param alignment The required alignment; must be a power of two.
+ * @param size The number of bytes requested to be allocated.
+ *
+ * @return If alignment is not a power of two, NULL is returned and sf_errno is
+ * set to EINVAL.  If size is 0, NULL is returned without setting sf_errno.
+ * Otherwise the aligned payload is returned, or NULL with sf_errno set to
+ * ENOMEM if the heap cannot satisfy the request.  The block is released with
+ * sf_free and can be resized with sf_realloc like any other block.
+ */
+void *sf_memalign(size_t alignment, size_t size);
+
+/*
+ * @return The number of bytes the caller may use at ptr, which is at least
+ * the size that was requested.  If ptr is NULL or does not point at an
+ * allocated block, 0 is returned.
+ */
+size_t sf_malloc_usable_size(void *ptr);
+
+/*
+ * @return The number of usable bytes sf_malloc(size) provides, i.e. size rounded
+ * up to what its block holds.  A splinter too small to split off may be left in
+ * the block, so sf_malloc_usable_size on the result can still report more.  If
+ * size is 0 or too large to ever be allocated, 0 is returned.
+ */
+size_t sf_good_size(size_t size);
+
+/* A payload together with the number of bytes the caller may use there. */
+typedef struct sf_sized_ptr {
+    void *ptr;
+    size_t size;
+} sf_sized_ptr_t;
+
+/*
+ * Allocates like sf_malloc and also reports the usable size of the block, so a
+ * growable buffer can use all of it.  The whole usable size counts as payload
+ * for sf_utilization.
+ *
+ * @return ptr and size as sf_malloc and sf_malloc_usable_size would; on failure
+ * ptr is NULL, size is 0 and sf_errno is set as by sf_malloc.
+ */
+sf_sized_ptr_t sf_malloc_sized(size_t size);
+
+/*
+ * A private heap.  Its blocks are carved from segments of the default heap and
+ * never mix with blocks of other heaps, so that the whole heap can be released
+ * at once.  Heaps are not thread-safe, but different threads may use different
+ * heaps as long as calls into the allocator are serialized.
+ */
+typedef struct sf_heap sf_heap_t;
+
+/*
+ * Creates an empty private heap.
+ *
+ * @return The new heap, or NULL with sf_errno set to ENOMEM.
+ */
+sf_heap_t *sf_heap_create(void);
+
+/*
+ * Releases a private heap together with every block still allocated from it.
+ * This takes time proportional to the number of segments of the heap, not the
+ * number of blocks.  Pointers into the heap must not be used afterwards.
+ */
+void sf_heap_destroy(sf_heap_t *heap);
+
+/*
+ * sf_malloc, sf_free, sf_realloc and sf_memalign on a given heap; a NULL heap
+ * means the default heap that sf_malloc uses.  Blocks of a private heap may
+ * also be passed to sf_free and sf_realloc, which find their heap themselves.
+ */
+void *sf_heap_malloc(sf_heap_t *heap, size_t size);
+void sf_heap_free(sf_heap_t *heap, void *ptr);
+void *sf_heap_realloc(sf_heap_t *heap, void *ptr, size_t size);
+void *sf_heap_memalign(sf_heap_t *heap, size_t alignment, size_t size);
+
+/*
+ * Placement policies for sf_heap_set_placement.
+ */
+#define SF_FIRST_FIT    0   /* First block that fits in LIFO-ordered lists (the default). */
+#define SF_BEST_FIT     1   /* Smallest of the first few blocks that fit. */
+#define SF_ADDRESS_FIT  2   /* First fit over lists kept in address order. */
+
+/*
+ * Selects how a heap (the default heap if heap is NULL) picks a free block.
+ * SF_BEST_FIT compares up to candidates fitting blocks, or 8 if candidates
+ * is 0.  SF_ADDRESS_FIT keeps live blocks packed toward the start of the
+ * heap at the price of an ordered insert on every free.  The policy can be
+ * changed at any time.
+ *
+ * @return 0 on success.  If policy is unknown or candidates is negative, -1
+ * is returned and sf_errno is set to EINVAL.
+ */
+int sf_heap_set_placement(sf_heap_t *heap, int policy, int candidates);
+
+/*
+ * Turns on cache coloring for a heap (the default heap if heap is NULL):
+ * blocks for requests of at least min_size bytes (a page if min_size is 0)
+ * start 0, 1, ..., colors - 1 cache lines (64 bytes) further into the free
+ * block they are carved from, in rotation, so that large buffers used
+ * together do not all map to the same cache sets.  The skipped bytes stay a
+ * free block in front of the colored one and are merged back when either is
+ * freed.  colors of 0 or 1 turns coloring off.
+ *
+ * @return 0 on success.  If colors is negative or more than 64, -1 is
+ * returned and sf_errno is set to EINVAL.
+ */
+int sf_heap_set_coloring(sf_heap_t *heap, int colors, size_t min_size);
+
+/*
+ * A persistent heap is a private heap kept in a file that is mapped at the
+ * same address in every process that opens it, so that its objects, and the
+ * pointers between them, survive a restart: reopening the file is a single
+ * mmap.  It is used with sf_heap_malloc and the other sf_heap_* calls, and
+ * its blocks may be passed to sf_free and sf_realloc.  The file does not
+ * grow; its size is fixed when it is created.
+ *
+ * Changes reach the file through the shared mapping as they are made.
+ * sf_pheap_flush writes them to disk and then marks the file clean; the
+ * first change after that marks it dirty again, on disk, before it is made.
+ * A file that is opened while still dirty, e.g. after a crash, has its free
+ * lists rebuilt from a walk over its blocks, which also happens when the
+ * header key or the size classes (SFMM_CONF) changed since it was written.
+ * A persistent heap is not supported with the side table (SIDE_TABLE=1).
+ */
+
+/*
+ * Opens the persistent heap in the file at path, or creates it with the
+ * given size, a multiple of PAGE_SZ between 4 pages and 4 GiB, mapped at
+ * base (page aligned), or at a default address if base is NULL.  For an
+ * existing file, size and base are ignored.  Open it before the first
+ * allocation so that the process adopts the header key of the file and
+ * reopening does not have to touch every block.
+ *
+ * @return The heap.  On failure NULL is returned and sf_errno is set:
+ * EINVAL if the arguments are invalid or the file is not a persistent heap
+ * of this build, EEXIST if its address range is taken, EIO if a block was
+ * found damaged while the lists were rebuilt, ENOTSUP with the side table,
+ * or the error of the failed system call.
+ */
+sf_heap_t *sf_pheap_open(const char *path, size_t size, void *base);
+
+/*
+ * Writes every change to disk and marks the file clean.
+ *
+ * @return 0 on success, or -1 with sf_errno set by msync, or to EINVAL if
+ * heap is not a persistent heap.
+ */
+int sf_pheap_flush(sf_heap_t *heap);
+
+/*
+ * Flushes the heap and unmaps it.  Its pointers must not be used afterwards.
+ *
+ * @return The result of the flush.
+ */
+int sf_pheap_close(sf_heap_t *heap);
+
+/*
+ * The root pointer is kept in the file so that a process can find its
+ * objects again after reopening the heap.
+ *
+ * @return The root pointer, NULL if none was set or heap is not persistent.
+ */
+void *sf_pheap_root(sf_heap_t *heap);
+
+/*
+ * @return 0 on success.  If heap is not persistent or root is neither NULL
+ * nor inside the heap's file, -1 is returned and sf_errno is set to EINVAL.
+ */
+int sf_pheap_set_root(sf_heap_t *heap, void *root);
+
+/*
+ * Movable objects.  An object allocated with sf_halloc is named by a handle
+ * rather than by its address, which the allocator may change while nothing
+ * holds it: its address is only stable between sf_hpin and the matching
+ * sf_hunpin.  sf_hcompact slides unpinned objects toward sf_mem_start(), so
+ * that free space gathers in the top chunk, whose pages sf_trim returns to
+ * the system.  Handles live in the default heap and are not thread-safe.
+ */
+typedef size_t sf_handle_t;
+
+/*
+ * Allocates a movable object of size bytes.
+ *
+ * @return The handle, never 0.  If size is 0, 0 is returned without setting
+ * sf_errno; if the object or the handle cannot be allocated, 0 is returned
+ * with sf_errno set to ENOMEM.
+ */
+sf_handle_t sf_halloc(size_t size);
+
+/*
+ * Pins the object so that it does not move; pins nest.  Aborts if h is not
+ * a live handle.
+ *
+ * @return The object's address, valid until it is unpinned as often as it
+ * was pinned.
+ */
+void *sf_hpin(sf_handle_t h);
+
+/*
+ * Drops one pin.  Aborts if h is not a live handle or is not pinned.
+ */
+void sf_hunpin(sf_handle_t h);
+
+/*
+ * Frees the object and its handle.  Aborts if h is not a live handle or is
+ * still pinned.
+ */
+void sf_hfree(sf_handle_t h);
+
+/*
+ * Moves unpinned objects into the lowest free blocks below them, resuming
+ * where the previous call stopped, until budget bytes were moved, or over
+ * every handle once if budget is 0.  Must not run concurrently with other
+ * calls into the allocator.
+ *
+ * @return The number of bytes moved; 0 means no object could be moved lower.
+ */
+size_t sf_hcompact(size_t budget);
+
+/*
+ * Returns memory that is free to the system.  Segments of the lifetime heaps
+ * (see sf_malloc_hint) that hold no object go back to the default heap, and
+ * the whole pages inside every free block of the default heap are released
+ * with madvise(MADV_DONTNEED).  They stay mapped and read as zero when reused.
+ * Must not run concurrently with other calls into the allocator.
+ *
+ * @return The number of bytes released.
+ */
+size_t sf_trim(void);
+
+/*
+ * Writes a binary snapshot of the default heap's block layout to fd: the
+ * offset, size, state, requested payload and size class of every block, in
+ * address order.  The format is described in sfdump.h, and
+ * tools/sfdump_analyze summarizes a snapshot offline.  Segments of private
+ * heaps appear as allocated blocks.  Must not run concurrently with other
+ * calls into the allocator.
+ *
+ * @return 0 on success.  If a write fails, -1 is returned and sf_errno is set
+ * to the error of the write.
+ */
+int sf_heap_dump(int fd);
+
+/*
+ * Lifetime hints for sf_malloc_hint.
+ */
+#define SF_SHORT_LIVED  1   /* Freed soon, e.g. within the request that made it. */
+#define SF_LONG_LIVED   2   /* Kept for a long time, e.g. a cache entry. */
+#define SF_AUTO_LIVED   4   /* Inferred from what became of earlier objects of the call site. */
+
+/*
+ * Allocates size bytes in a heap reserved for objects of the hinted lifetime.
+ * Short- and long-lived objects each have a private heap with its own free
+ * lists, whose segments hold objects of that lifetime only.  Long-lived
+ * objects are then not left stranded between freed short-lived ones, and a
+ * segment of short-lived objects empties out as a whole, to be reclaimed by
+ * sf_trim.  The block is freed with sf_free and may be resized with
+ * sf_realloc.
+ *
+ * With SF_AUTO_LIVED, the lifetime of one in 16 objects from each caller is
+ * measured, and a caller's objects go to the short-lived heap once most of
+ * its measured objects were freed within 4096 such allocations; until then
+ * they are treated as long-lived.  The caller is the return address, so a
+ * wrapper that the compiler turns into a tail call passes its own callers
+ * through.  Automatic mode keeps its statistics unsynchronized, so it must not
+ * be called concurrently.
+ *
+ * @return The block, or NULL: if hint is none of the above sf_errno is set to
+ * EINVAL, and otherwise as for sf_malloc.
+ */
+void *sf_malloc_hint(size_t size, int hint);
+
+/*
+ * Allocates size bytes close to hint, a block returned by an earlier
+ * allocation, for objects that are used together, such as a node and the
+ * nodes it points to.  A free block of the right size on hint's page or the
+ * pages next to it, found among the first 32 blocks of its quick list, is
+ * used first.  Otherwise, if the block right after hint is free and big
+ * enough, the front of it is used, and then the back of the block right before
+ * hint.  Failing all of these, the block comes from hint's heap as it would for
+ * sf_malloc.  If hint is NULL, this is sf_malloc.
+ *
+ * @return The block, or NULL as for sf_malloc.
+ */
+void *sf_malloc_near(void *hint, size_t size);
+
+/*
+ * A region bump-allocates objects from chunks of a heap.  Objects carry no
+ * per-object metadata and cannot be freed individually; they all go away
+ * together when the region is reset or destroyed.
+ */
+typedef struct sf_region sf_region_t;
+
+/*
+ * Creates a region whose chunks come from heap, or from the default heap if
+ * heap is NULL.
+ *
+ * @return The new region, or NULL with sf_errno set to ENOMEM.
+ */
+sf_region_t *sf_region_create(sf_heap_t *heap);
+
+/*
+ * @return A 16-byte aligned object of at least size bytes, or NULL if size
+ * is 0.  If a new chunk cannot be obtained, NULL is returned and sf_errno is
+ * set to ENOMEM.
+ */
+void *sf_region_alloc(sf_region_t *region, size_t size);
+
+/*
+ * Discards every object of the region in constant time.  The chunks stay
+ * with the region and are reused by later allocations.
+ */
+void sf_region_reset(sf_region_t *region);
+
+/*
+ * Discards every object of the region and returns its chunks to the heap as
+ * whole blocks.
+ */
+void sf_region_destroy(sf_region_t *region);
+
+/*
+ * A pool hands out objects of one fixed size.  Objects are packed into
+ * chunks of the default heap without per-object headers, and freed objects
+ * are reused before new ones are carved.
+ */
+typedef struct sf_pool sf_pool_t;
+
+typedef struct sf_pool_stats {
+    size_t object_size;     // Size of the objects, as passed to sf_pool_create.
+    size_t chunks;          // Chunks currently taken from the heap.
+    size_t capacity;        // Objects those chunks can hold.
+    size_t in_use;          // Objects currently allocated.
+    size_t heap_bytes;      // Bytes of heap the chunks occupy.
+} sf_pool_stats_t;
+
+/*
+ * Creates a pool of objects of obj_size bytes whose addresses are multiples
+ * of align.  An align of 0 means pointer alignment.
+ *
+ * @return The new pool.  If align is not a power of two or exceeds PAGE_SZ,
+ * or obj_size is larger than a chunk, NULL is returned and sf_errno is set
+ * to EINVAL.  If the heap is exhausted, sf_errno is set to ENOMEM.
+ */
+sf_pool_t *sf_pool_create(size_t obj_size, size_t align);
+
+/*
+ * Releases the pool and all of its chunks, including objects still in use.
+ */
+void sf_pool_destroy(sf_pool_t *pool);
+
+/*
+ * @return An object of the pool, or NULL with sf_errno set to ENOMEM.
+ */
+void *sf_pool_alloc(sf_pool_t *pool);
+
+/*
+ * Returns an object to its pool.  The last few freed objects are cached in
+ * the pool and handed out again first; when the cache overflows they go back
+ * to their chunks, and a chunk that becomes empty is freed to the heap unless
+ * it is the only chunk of the pool with room left.  Passing an object of
+ * another pool aborts the program.
+ */
+void sf_pool_free(sf_pool_t *pool, void *ptr);
+
+/*
+ * Flushes the cache of freed objects and frees every empty chunk the pool is
+ * still holding on to.
+ */
+void sf_pool_trim(sf_pool_t *pool);
+
+/*
+ * Fills in the occupancy of the pool.
+ */
+void sf_pool_stats(sf_pool_t *pool, sf_pool_stats_t *stats);
+
+/*
+ * Per-CPU caches of small blocks (up to the largest quick-list block size) of
+ * the default heap, for callers that share the heap between threads behind a
+ * lock.  sf_cpu_cache_alloc and sf_cpu_cache_free are lock-free, using Linux
+ * restartable sequences; only when they fail does the caller take its lock and
+ * call sf_cpu_cache_refill or sf_cpu_cache_drain, which move a batch of blocks
+ * between the current CPU's cache and the heap:
+ *
+ *     void *p = sf_cpu_cache_alloc(size);
+ *     if (p == NULL) { lock(); p = sf_cpu_cache_refill(size); unlock(); }
+ *
+ *     if (!sf_cpu_cache_free(p)) { lock(); sf_cpu_cache_drain(p); unlock(); }
+ *
+ * Blocks in the caches count as allocated for sf_utilization.  Where rseq is
+ * not available the caches stay empty and refill and drain are plain sf_malloc
+ * and sf_free.
+ */
+
+/*
+ * @return A cached block with room for size bytes, or NULL if the current
+ * CPU has none or size is not cached.
+ */
+void *sf_cpu_cache_alloc(size_t size);
+
+/*
+ * Caches a block of the default heap on the current CPU.
+ *
+ * @return 1 if the block was cached, 0 if it is too large or the cache is full.
+ */
+int sf_cpu_cache_free(void *ptr);
+
+/*
+ * Allocates a block for size bytes, and for a cached size a batch more of the
+ * same size into the current CPU's cache.  Call with the heap lock held.
+ *
+ * @return The block, or NULL with sf_errno set as by sf_malloc.
+ */
+void *sf_cpu_cache_refill(size_t size);
+
+/*
+ * Frees a batch of blocks of ptr's size from the current CPU's cache back to
+ * the heap, then caches ptr, or frees it too if it still does not fit.  Call
+ * with the heap lock held.
+ */
+void sf_cpu_cache_drain(void *ptr);
+
+/*
+ * Asynchronous free.  While it is on, sf_free of a block of the default heap
+ * too large for a quick list only puts the block on a lock-free queue; a
+ * background thread takes the queue in batches, sorts each batch by address
+ * and coalesces the blocks into the free lists.  The block's memory becomes
+ * available again once the thread gets to it.
+ *
+ * When the queue is full, sf_free releases the block itself, as it does when
+ * asynchronous free is off.  Freeing a queued block again aborts.
+ */
+
+/*
+ * Starts the background thread.  depth is the capacity of the queue, a power
+ * of two, or 0 for 1024.  The thread releases blocks into the heap while the
+ * program keeps allocating from it, so the heap is shared even in a
+ * single-threaded program: pass functions that take and release a lock (with
+ * arg as their argument), and hold that lock around every other call into the
+ * allocator.  The thread holds it while it releases a batch.  Only with
+ * fine-grained locking (LOCKS=fine) may both be NULL.  Must not run
+ * concurrently with other calls into the allocator.
+ *
+ * @return 0 on success.  If it is already running, depth is not a power of
+ * two, only one of lock and unlock is given, or neither is given without
+ * fine-grained locking, -1 is returned and sf_errno is set to EINVAL; if the
+ * queue cannot be allocated or the thread cannot be created, -1 is returned
+ * with sf_errno set to ENOMEM or EAGAIN.
+ */
+int sf_async_free_start(size_t depth, void (*lock)(void *), void (*unlock)(void *), void *arg);
+
+/*
+ * Waits until every block queued so far is back in the free lists.  Must be
+ * called without the lock given to sf_async_free_start held.
+ */
+void sf_async_free_flush(void);
+
+/*
+ * Releases what is still queued and stops the background thread; later frees
+ * are done inline again.  Must be called without the lock held and must not
+ * run concurrently with other calls into the allocator.
+ */
+void sf_async_free_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
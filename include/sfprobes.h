@@ -0,0 +1,52 @@
+#ifndef SFPROBES_H
+#define SFPROBES_H
+
+/*
+ * Static tracepoints (USDT) on the allocator's paths, under the provider "sfmm":
+ *
+ *   malloc_entry(size)                       every heap_malloc call
+ *   malloc_exit(ptr, size, block_size)       ptr is NULL on failure
+ *   free(ptr, block_size)
+ *   quick_hit(block, block_size)
+ *   quick_miss(block_size)                   quick-list size, but the list was empty
+ *   free_list_search(block_size, block, passes)
+ *                                            passes: 1 plain, 2 after consolidating,
+ *                                            3 after expanding the heap; block may be NULL
+ *   split(block, block_size, remainder_size)
+ *   coalesce(block, old_size, new_size)      old_size == new_size if nothing merged
+ *   quick_flush(index, count)                a quick list reached quick_max
+ *   consolidate(heap, count)                 a miss merged the deferred quick-list blocks
+ *   expand_heap(heap, requested)
+ *
+ * With <sys/sdt.h> available each probe compiles to a single nop plus an ELF note, which
+ * bpftrace or perf patch when attached, e.g.
+ *
+ *   bpftrace -e 'usdt:./app:sfmm:expand_heap { @[ustack] = count(); }'
+ *
+ * Without it, or with -DSF_NO_USDT (make USDT=0), the probes compile to nothing.
+ * -DSF_USDT_REQUIRED (make USDT=1) makes a missing header an error instead.
+ */
+
+#if !defined(SF_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SF_USDT 1
+#endif
+#endif
+
+#if defined(SF_USDT_REQUIRED) && !defined(SF_USDT)
+#error "USDT probes were requested but <sys/sdt.h> is not available"
+#endif
+
+#ifdef SF_USDT
+#define SF_PROBE1(name, a)          DTRACE_PROBE1(sfmm, name, a)
+#define SF_PROBE2(name, a, b)       DTRACE_PROBE2(sfmm, name, a, b)
+#define SF_PROBE3(name, a, b, c)    DTRACE_PROBE3(sfmm, name, a, b, c)
+#else
+// sizeof keeps the arguments "used" without evaluating them
+#define SF_PROBE1(name, a)          do { (void)sizeof(a); } while (0)
+#define SF_PROBE2(name, a, b)       do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define SF_PROBE3(name, a, b, c)    do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#endif
+
+#endif
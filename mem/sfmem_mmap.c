@@ -0,0 +1,82 @@
+/**
+ * Page source backed by the operating system.
+ *
+ * lib/sfutil.o hands out pages from a fixed 37-page arena, which is fine for
+ * the unit tests but far too small for benchmarks or for interposing a real
+ * process' allocations.  This file provides the same sf_mem_* / sf_magic
+ * interface on top of one large anonymous mapping that is reserved up front
+ * and handed out a page at a time, so the heap stays contiguous exactly as
+ * sfmm.c expects.  Link it instead of lib/sfutil.o, never together with it.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "debug.h"
+#include "sfmm.h"
+
+/*
+ * Size of the address range reserved for the heap (not committed memory).
+ * Block sizes are 32-bit header fields, so a larger heap could coalesce free
+ * blocks that no longer fit in a header.
+ */
+#ifndef SF_MEM_RESERVE
+#define SF_MEM_RESERVE ((size_t)1 << 32)
+#endif
+
+static char *mem_start = NULL;
+static char *mem_end = NULL;
+static char *mem_limit = NULL;
+static sf_header mem_magic = 0;
+static int magic_initialized = 0;
+
+static int reserve_heap() {
+    if (mem_start != NULL) {
+        return 0;
+    }
+    // Back off until the kernel agrees to the reservation
+    for (size_t size = SF_MEM_RESERVE; size >= 64 * PAGE_SZ; size >>= 1) {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED) {
+            mem_start = mem_end = (char *)p;
+            mem_limit = mem_start + size;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void *sf_mem_start() {
+    reserve_heap();
+    return mem_start;
+}
+
+void *sf_mem_end() {
+    reserve_heap();
+    return mem_end;
+}
+
+void *sf_mem_grow() {
+    if (reserve_heap() != 0 || mem_end + PAGE_SZ > mem_limit) {
+        return NULL;
+    }
+    char *page = mem_end;
+    mem_end += PAGE_SZ;
+    return page;
+}
+
+sf_header sf_magic() {
+    if (!magic_initialized) {
+        // Any per-process value will do; it only has to differ between runs
+        mem_magic = ((sf_header)getpid() << 32) ^ (sf_header)(uintptr_t)&mem_magic;
+        magic_initialized = 1;
+    }
+    return mem_magic;
+}
+
+void sf_set_magic(sf_header magic) {
+    mem_magic = magic;
+    magic_initialized = 1;
+}
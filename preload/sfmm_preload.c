@@ -0,0 +1,251 @@
+/**
+ * LD_PRELOAD shim that routes the C library's malloc family to sfmm.
+ *
+ *     LD_PRELOAD=bin/libsfmm.so <program>
+ *
+ * The library is linked against the mmap page source in mem/ instead of
+ * lib/sfutil.o, and every entry point is serialized by one mutex because the
+ * allocator itself is not thread-safe.
+ *
+ * Built with PERCPU=1 (-DSF_PERCPU), small requests are served from the
+ * per-CPU caches of src/sfcpucache.c first and take the mutex only to refill
+ * or drain a cache.
+ *
+ * Early-init recursion: anything the allocator or the C library does while a
+ * call is already in progress on the same thread (for example a diagnostic
+ * that allocates) must not take the lock again.  Those nested requests are
+ * served from a small static bootstrap arena whose blocks are never freed.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+#define BOOTSTRAP_SIZE (64 * 1024)
+#define BOOTSTRAP_ALIGN 16
+
+static pthread_mutex_t sf_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int in_allocator __attribute__((tls_model("initial-exec")));
+
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(BOOTSTRAP_ALIGN)));
+static size_t bootstrap_used = 0;
+
+/*
+    Locking and recursion guard
+*/
+
+static int enter() {
+    if (in_allocator) {
+        return 0;
+    }
+    in_allocator = 1;
+    pthread_mutex_lock(&sf_lock);
+    return 1;
+}
+
+static void leave() {
+    pthread_mutex_unlock(&sf_lock);
+    in_allocator = 0;
+}
+
+static void fork_prepare() {
+    pthread_mutex_lock(&sf_lock);
+}
+
+static void fork_release() {
+    pthread_mutex_unlock(&sf_lock);
+}
+
+__attribute__((constructor)) static void preload_init() {
+    // Keep the heap consistent in a child forked while another thread allocates
+    pthread_atfork(fork_prepare, fork_release, fork_release);
+}
+
+/*
+    Bootstrap arena
+*/
+
+static void *bootstrap_alloc(size_t alignment, size_t size) {
+    if (alignment < BOOTSTRAP_ALIGN) {
+        alignment = BOOTSTRAP_ALIGN;
+    }
+    size_t start = (bootstrap_used + alignment - 1) & ~(alignment - 1);
+    if (start > BOOTSTRAP_SIZE || size > BOOTSTRAP_SIZE - start) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    bootstrap_used = start + size;
+    return bootstrap + start;
+}
+
+static int in_bootstrap(void *ptr) {
+    return (char *)ptr >= bootstrap && (char *)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+/*
+    Allocation core shared by the public entry points
+*/
+
+static void *preload_memalign(size_t alignment, size_t size) {
+    // malloc(0) must still return a unique pointer
+    if (size == 0) {
+        size = 1;
+    }
+    if (!enter()) {
+        return bootstrap_alloc(alignment, size);
+    }
+    sf_errno = 0;
+    void *ptr = sf_memalign(alignment, size);
+    int err = sf_errno;
+    leave();
+    if (ptr == NULL) {
+        errno = err ? err : ENOMEM;
+    }
+    return ptr;
+}
+
+/*
+    Interposed C library functions
+*/
+
+void *malloc(size_t size) {
+#ifdef SF_PERCPU
+    void *cached = sf_cpu_cache_alloc(size);
+    if (cached != NULL) {
+        return cached;
+    }
+    if (size != 0 && enter()) {
+        sf_errno = 0;
+        void *ptr = sf_cpu_cache_refill(size);
+        int err = sf_errno;
+        leave();
+        if (ptr == NULL) {
+            errno = err ? err : ENOMEM;
+        }
+        return ptr;
+    }
+#endif
+    return preload_memalign(BOOTSTRAP_ALIGN, size);
+}
+
+void free(void *ptr) {
+    if (ptr == NULL || in_bootstrap(ptr)) {
+        return;
+    }
+#ifdef SF_PERCPU
+    if (sf_cpu_cache_free(ptr)) {
+        return;
+    }
+#endif
+    if (!enter()) {
+        // A nested call can only release bootstrap memory
+        return;
+    }
+#ifdef SF_PERCPU
+    sf_cpu_cache_drain(ptr);
+#else
+    sf_free(ptr);
+#endif
+    leave();
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // Not malloc(): the compiler may fuse malloc + memset into a call to calloc
+    void *ptr = preload_memalign(BOOTSTRAP_ALIGN, nmemb * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, nmemb * size);
+    }
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (in_bootstrap(ptr)) {
+        // Move the block out of the bootstrap arena; its old size is unknown,
+        // so copy no more than what is left of the arena behind it.
+        void *moved = malloc(size);
+        if (moved != NULL) {
+            size_t avail = bootstrap + BOOTSTRAP_SIZE - (char *)ptr;
+            memcpy(moved, ptr, size < avail ? size : avail);
+        }
+        return moved;
+    }
+    if (!enter()) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    sf_errno = 0;
+    void *moved = sf_realloc(ptr, size);
+    int err = sf_errno;
+    leave();
+    if (moved == NULL) {
+        errno = err ? err : ENOMEM;
+    }
+    return moved;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *ptr = preload_memalign(alignment, size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return preload_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return preload_memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return preload_memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (in_bootstrap(ptr)) {
+        return 0;
+    }
+    if (!enter()) {
+        return 0;
+    }
+    size_t usable = sf_malloc_usable_size(ptr);
+    leave();
+    return usable;
+}
@@ -0,0 +1,280 @@
+/**
+ * Per-CPU caches of small blocks in front of the default heap.
+ *
+ * Every CPU has a small stack of free blocks for each quick-list size class.
+ * Blocks are pushed and popped with Linux restartable sequences (rseq): each
+ * operation is a short critical section that the kernel restarts if the thread
+ * is preempted, migrated or signaled before its single committing store, so the
+ * fast path takes no lock and executes no atomic instruction.  The memory held
+ * in caches is bounded by the number of CPUs instead of the number of threads,
+ * and a thread that goes idle strands nothing.
+ *
+ * Only sf_cpu_cache_alloc and sf_cpu_cache_free are lock-free.  Refilling and
+ * draining move a batch of blocks between a cache and the heap, so the caller
+ * runs them under the lock it uses for every other heap call.  Without rseq
+ * (other architectures, old kernels or C libraries) the caches stay empty and
+ * every call takes the locked path.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define CPU_CACHE_RSEQ 1
+#endif
+#endif
+
+#define CPU_CACHE_CLASSES NUM_QUICK_LISTS
+// Slots per class; with the count this makes a class exactly four cache lines
+#define CPU_CACHE_SLOTS 31
+// Blocks moved between a cache and the heap at a time
+#define CPU_CACHE_BATCH 16
+
+typedef struct sf_cpu_class {
+    uint32_t count;                 // Written only by the committing store of a critical section.
+    uint32_t unused;
+    void *slots[CPU_CACHE_SLOTS];
+} sf_cpu_class;
+
+typedef struct sf_cpu_cache {
+    sf_cpu_class classes[CPU_CACHE_CLASSES];
+} sf_cpu_cache;
+
+// Set once, under the caller's lock, by cache_ready()
+static sf_cpu_cache *caches = NULL;
+static long cache_cpus = 0;
+static int cache_unavailable = 0;
+
+static int class_of(size_t usable);
+static int cache_ready(void);
+static void *cache_pop(int cls);
+static int cache_push(int cls, void *ptr);
+
+void *sf_cpu_cache_alloc(size_t size) {
+    int cls = class_of(sf_good_size(size));
+    if (cls < 0){
+        return NULL;
+    }
+    return cache_pop(cls);
+}
+
+int sf_cpu_cache_free(void *ptr) {
+    int cls = class_of(sf_malloc_usable_size(ptr));
+    if (cls < 0){
+        return 0;
+    }
+    return cache_push(cls, ptr);
+}
+
+void *sf_cpu_cache_refill(size_t size) {
+    int cls = class_of(sf_good_size(size));
+    if (cls < 0 || !cache_ready()){
+        return sf_malloc(size);
+    }
+    // Every block of the batch gets the full usable size of the class
+    size_t usable = sf_good_size(size);
+    void *first = sf_malloc(usable);
+    for (int i = 1; first != NULL && i < CPU_CACHE_BATCH; i++){
+        void *ptr = sf_malloc(usable);
+        if (ptr == NULL){
+            break;
+        }
+        if (!cache_push(cls, ptr)){
+            // Another thread on this CPU filled the cache meanwhile
+            sf_free(ptr);
+            break;
+        }
+    }
+    return first;
+}
+
+void sf_cpu_cache_drain(void *ptr) {
+    int cls = class_of(sf_malloc_usable_size(ptr));
+    if (cls < 0 || !cache_ready()){
+        sf_free(ptr);
+        return;
+    }
+    for (int i = 0; i < CPU_CACHE_BATCH; i++){
+        void *cached = cache_pop(cls);
+        if (cached == NULL){
+            break;
+        }
+        sf_free(cached);
+    }
+    if (!cache_push(cls, ptr)){
+        sf_free(ptr);
+    }
+}
+
+/**
+ * Size class of a block with the given usable size, or -1 if it is not cached.
+ * The classes are the quick-list block sizes: 32, 48, ... bytes.
+ */
+
+static int class_of(size_t usable) {
+    if (usable == 0){
+        return -1;
+    }
+    size_t cls = usable / 16 - 1;
+    return cls < CPU_CACHE_CLASSES ? (int)cls : -1;
+}
+
+#ifdef CPU_CACHE_RSEQ
+
+static struct rseq *thread_rseq(void) {
+    return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+/**
+ * Maps the caches the first time a refill or drain runs.  Returns 0 if this
+ * thread has no rseq area registered by the C library.
+ */
+
+static int cache_ready(void) {
+    if (__atomic_load_n(&caches, __ATOMIC_ACQUIRE) != NULL){
+        return 1;
+    }
+    if (cache_unavailable){
+        return 0;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (__rseq_size == 0 || (int32_t)thread_rseq()->cpu_id < 0 || cpus <= 0){
+        cache_unavailable = 1;
+        return 0;
+    }
+    // Kept out of the heap so that the caches never show up as blocks
+    void *map = mmap(NULL, cpus * sizeof(sf_cpu_cache), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED){
+        cache_unavailable = 1;
+        return 0;
+    }
+    cache_cpus = cpus;
+    __atomic_store_n(&caches, (sf_cpu_cache *)map, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * The critical sections below follow the usual rseq layout: a struct rseq_cs
+ * descriptor in the __rseq_cs section, stored into the thread's rseq area before
+ * the section starts (label 1), the commit as the last instruction before label 2,
+ * and an abort handler, preceded by the RSEQ_SIG signature, in __rseq_failure.
+ * The section checks that the thread is still on the CPU whose cache it indexed.
+ */
+#define RSEQ_CS_DESCRIPTOR \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    "3:\n\t" \
+    ".long 0x0, 0x0\n\t" \
+    ".quad 1f, (2f - 1f), 4f\n\t" \
+    ".popsection\n\t" \
+    "leaq 3b(%%rip), %%rax\n\t" \
+    "movq %%rax, %[rseq_cs]\n\t"
+
+#define RSEQ_CS_ABORT(label) \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".byte 0x0f, 0xb9, 0x3d\n\t" \
+    ".long 0x53053053\n\t" \
+    "4:\n\t" \
+    "jmp %l[" #label "]\n\t" \
+    ".popsection\n\t"
+
+static void *cache_pop(int cls) {
+    sf_cpu_cache *all = __atomic_load_n(&caches, __ATOMIC_ACQUIRE);
+    if (all == NULL){
+        return NULL;
+    }
+    struct rseq *rs = thread_rseq();
+    // A thread whose rseq area is not registered never matches cpu_id and would abort forever
+    if (*(volatile int32_t *)&rs->cpu_id < 0){
+        return NULL;
+    }
+    void *ptr;
+restart:;
+    int32_t cpu = *(volatile int32_t *)&rs->cpu_id_start;
+    if (cpu >= cache_cpus){
+        return NULL;
+    }
+    sf_cpu_class *c = &all[cpu].classes[cls];
+    __asm__ goto (
+        RSEQ_CS_DESCRIPTOR
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 4f\n\t"
+        "movl %[count], %%eax\n\t"
+        "testl %%eax, %%eax\n\t"
+        "jz %l[empty]\n\t"
+        "subl $1, %%eax\n\t"
+        "movq 8(%[c], %%rax, 8), %[ptr]\n\t"
+        "movl %%eax, %[count]\n\t"
+        "2:\n\t"
+        RSEQ_CS_ABORT(restart)
+        : [ptr] "=&r" (ptr)
+        : [rseq_cs] "m" (rs->rseq_cs), [cpu] "r" (cpu), [cpu_id] "m" (rs->cpu_id),
+          [count] "m" (c->count), [c] "r" (c)
+        : "memory", "cc", "rax"
+        : empty, restart);
+    return ptr;
+empty:
+    return NULL;
+}
+
+static int cache_push(int cls, void *ptr) {
+    sf_cpu_cache *all = __atomic_load_n(&caches, __ATOMIC_ACQUIRE);
+    if (all == NULL){
+        return 0;
+    }
+    struct rseq *rs = thread_rseq();
+    // A thread whose rseq area is not registered never matches cpu_id and would abort forever
+    if (*(volatile int32_t *)&rs->cpu_id < 0){
+        return 0;
+    }
+restart:;
+    int32_t cpu = *(volatile int32_t *)&rs->cpu_id_start;
+    if (cpu >= cache_cpus){
+        return 0;
+    }
+    sf_cpu_class *c = &all[cpu].classes[cls];
+    __asm__ goto (
+        RSEQ_CS_DESCRIPTOR
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 4f\n\t"
+        "movl %[count], %%eax\n\t"
+        "cmpl %[slots], %%eax\n\t"
+        "jae %l[full]\n\t"
+        "movq %[ptr], 8(%[c], %%rax, 8)\n\t"
+        "addl $1, %%eax\n\t"
+        "movl %%eax, %[count]\n\t"
+        "2:\n\t"
+        RSEQ_CS_ABORT(restart)
+        :
+        : [rseq_cs] "m" (rs->rseq_cs), [cpu] "r" (cpu), [cpu_id] "m" (rs->cpu_id),
+          [count] "m" (c->count), [c] "r" (c), [ptr] "r" (ptr), [slots] "i" (CPU_CACHE_SLOTS)
+        : "memory", "cc", "rax"
+        : full, restart);
+    return 1;
+full:
+    return 0;
+}
+
+#else
+
+static int cache_ready(void) {
+    return 0;
+}
+
+static void *cache_pop(int cls) {
+    return NULL;
+}
+
+static int cache_push(int cls, void *ptr) {
+    return 0;
+}
+
+#endif
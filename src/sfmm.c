@@ -2,121 +2,523 @@
  * Do not submit your assignment with a main function in this file.
  * If you submit with a main function in this file, you will get a zero.
  */
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "debug.h"
 #include "sfmm.h"
+#include "sfmm_ext.h"
+#include "sfdump.h"
+#include "sfclasses.h"
+#include "sfprobes.h"
 
 #define WSIZE 8
-#define DSIZE 16 
+#define DSIZE 16
 #define MIN_BLOCK_SIZE 32
 #define MAX_QUICK_LIST_BLOCK_SIZE (16 + (NUM_QUICK_LISTS * 16))
+// Block sizes and payload sizes both have to fit their 32-bit header fields
+#define MAX_PAYLOAD_SIZE ((size_t)0xFFFFFFF0 - DSIZE)
+
+/*
+ * Allocated blocks of a private heap carry this flag in one of the unused header bits,
+ * so that sf_free and sf_realloc can route them back to the heap that owns them.
+ */
+#define IN_PRIVATE_HEAP       0x4
+
+/*
+ * Private heaps get their memory in segments, which are ordinary allocated blocks of the
+ * default heap.  A segment starts with an sf_segment record and is laid out like the
+ * default heap after that: padding, prologue, blocks and an epilogue.
+ */
+#define SEGMENT_MIN_SIZE (4 * PAGE_SZ)
+#define SEGMENT_PROLOGUE_OFFSET (sizeof(sf_segment) + WSIZE)
+#define SEGMENT_OVERHEAD (SEGMENT_PROLOGUE_OFFSET + MIN_BLOCK_SIZE + WSIZE)
+
+/*
+ * A persistent heap is a private heap kept in a file mapped at a fixed address, so that the
+ * pointers in its lists and in the objects stay valid across runs.  The file starts with an
+ * sf_pheap_file record, which holds the heap itself, followed by a single segment that
+ * fills the rest of the file; it never grows.
+ */
+#define PHEAP_MAGIC 0x7366706865617031ULL      // "sfpheap1"
+#define PHEAP_BASE ((char *)0x600000000000)
+#define PHEAP_MIN_SIZE (4 * PAGE_SZ)
+// Leaves the free block spanning the segment within its 32-bit size field
+#define PHEAP_MAX_SIZE ((size_t)1 << 32)
+#define PHEAP_SEGMENT(file) \
+    ((sf_segment *)((char *)(file) + ((sizeof(sf_pheap_file) + DSIZE - 1) & ~(size_t)(DSIZE - 1))))
+#ifndef MAP_FIXED_NOREPLACE
+// Older C libraries; the address is then only a hint, which sf_pheap_open checks
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
+// Candidates SF_BEST_FIT inspects when the caller does not say
+#define BEST_FIT_CANDIDATES 8
+
+// Cache coloring: large blocks are offset by a rotating multiple of COLOR_LINE, at most a page
+#define COLOR_LINE 64
+#define MAX_COLORS ((int)(PAGE_SZ / COLOR_LINE))
+#define COLOR_MIN PAGE_SZ
+
+// Records sf_heap_dump buffers before each write
+#define DUMP_BATCH 256
+
+// Entries of each list sf_malloc_near looks through for a block near its hint
+#define NEAR_SCAN 32
+
+/*
+ * The default free-list classes come from tools/sfclasses.spec, from which the build
+ * generates sfclasses.h: block sizes up to SF_CLASS_TABLE_LIMIT are mapped to their
+ * free list by class_table.
+ */
+#define CLASS_TABLE_LIMIT SF_CLASS_TABLE_LIMIT
+
+/*
+ * Metadata obfuscation is selected at build time (see META in the Makefile):
+ *   SF_META_FAST      headers and footers are stored in the clear
+ *   SF_META_HARDENED  the key is loaded once at heap initialization, and block
+ *                     headers, footers and list links are checked before use
+ *   (neither)         every access XORs with MAGIC, i.e. calls sf_magic()
+ */
+#if defined(SF_META_FAST)
+#define META_KEY ((sf_header)0)
+#elif defined(SF_META_HARDENED)
+#define META_KEY sf_meta_key
+#else
+#define META_KEY MAGIC
+#endif
+
+#ifdef SF_META_HARDENED
+#define META_CHECK(cond)  do { if (!(cond)) abort(); } while (0)
+#else
+#define META_CHECK(cond)  do { } while (0)
+#endif
 
 // The GET/PUT/HEADER/FOOTER macros are from the CSE320 Textbook with slight adjustments
-#define GET(p)        ((*(sf_header *)(p)) ^ MAGIC)
-#define PUT(p, val)   (*(sf_header *)(p)) = ((val) ^ MAGIC)
+#define GET(p)        ((*(sf_header *)(p)) ^ META_KEY)
+#define PUT(p, val)   (*(sf_header *)(p)) = ((val) ^ META_KEY)
 
 #define IS_ALLOCATED(p)       ((GET(p) & THIS_BLOCK_ALLOCATED ) != 0)
 #define IS_IN_QUICK_LIST(p)   ((GET(p) & IN_QUICK_LIST ) != 0)
+#define IS_PRIVATE(p)         ((GET(p) & IN_PRIVATE_HEAP ) != 0)
 
-#define GET_SIZE(p)    ((uint64_t)(GET(p) & 0x00000000FFFFFFFF) & ~0xF)
+// The size field as written in a header
+#define HEADER_SIZE(p)  ((uint64_t)(GET(p) & 0x00000000FFFFFFFF) & ~0xF)
 #define GET_PAYLOAD(p)  (GET(p) >> 32)
+#ifdef SF_SIDE_TABLE
+#define GET_SIZE(p)     side_block_size(p)
+// No footer: the side table stands in for it
+#define BLOCK_OVERHEAD  sizeof(sf_header)
+#else
+#define GET_SIZE(p)     HEADER_SIZE(p)
+#define BLOCK_OVERHEAD  (sizeof(sf_header) + sizeof(sf_footer))
+#endif
 
 // pass in block pointer, get its header / footer
 #define HEADER(bp) ((char *)(bp) - WSIZE)
 #define FOOTER(bp) ((char *)(bp) + GET_SIZE(HEADER(bp)) - DSIZE)
 
+#ifdef SF_SIDE_TABLE
+/*
+ * Out-of-band block metadata (SIDE_TABLE=1 in the Makefile).  The default heap and every
+ * segment have a side table with two bits per 16-byte granule, indexed by header address:
+ * whether a block (or the epilogue) starts there, and whether that block is allocated.
+ * The size of a block is the distance to the next start, and every size the allocator uses
+ * is read from the table, so an overrun that rewrites a neighbor's header cannot move a
+ * block boundary or talk coalesce into merging with a live block.  Blocks have no footer,
+ * which leaves 8 more bytes of each block to its payload.  Headers still carry the payload
+ * size, the flags and a copy of the size, which valid_block checks against the table.
+ * Finding a size scans one bit per 16 bytes of the block, a word per kilobyte.
+ */
+typedef struct sf_side_table {
+    char *base;                 // Header address of granule 0, the prologue.
+    uint64_t *words;            // Start and allocated bitmaps, interleaved a word at a time.
+} sf_side_table;
+
+// Span of the default heap's table, reserved up front like the mmap page source's heap
+#define SIDE_TABLE_SPAN ((size_t)1 << 32)
+#define SIDE_WORDS(bytes) (2 * (((bytes) / DSIZE + 63) / 64))
+#define SIDE_GRANULE(t, p) ((size_t)((char *)(p) - (t)->base) / DSIZE)
+#define SIDE_STARTS(t, g) ((t)->words[2 * ((g) / 64)])
+#define SIDE_ALLOC(t, g) ((t)->words[2 * ((g) / 64) + 1])
+#define SIDE_BIT(g) ((uint64_t)1 << ((g) % 64))
+#endif
+
+#ifdef SF_FINE_LOCKS
+/*
+ * Fine-grained locking (LOCKS=fine in the Makefile).  sf_malloc, sf_free, sf_realloc and
+ * sf_memalign on the default heap may be called from several threads at once: every quick
+ * list and every free list has a lock of its own, and a header is only ever rewritten by
+ * whoever owns the block:
+ *   - an allocated block belongs to the caller, a quick-list block to its list's lock;
+ *   - a free block belongs to the lock of the list it is in, which the header tells: the
+ *     last list for the top chunk (flagged TOP_CHUNK), the list of its size otherwise;
+ *   - a block on its way between lists (being split, coalesced or carved) belongs to the
+ *     thread moving it and is marked allocated, so that its neighbors leave it alone.
+ * coalesce() reads a neighbor's header without a lock, takes the lock the header names and
+ * reads it again before taking the neighbor out of its list.  expand_heap and the top chunk
+ * are covered by the last list's lock.  No thread holds two list locks at once, and a quick
+ * list's lock is never held while a free list's is taken, so the locks need no order.
+ *
+ * Two neighbors released at the same moment may both miss each other and stay apart until
+ * one of their other neighbors is freed.  Private heaps, the heap walks and the
+ * configuration calls still need the caller's own synchronization.
+ */
+#ifdef SF_SIDE_TABLE
+#error "SF_FINE_LOCKS does not support SF_SIDE_TABLE, whose bitmap words are shared by neighbors"
+#endif
+
+#define TOP_CHUNK 0x8
+#define UNLISTED THIS_BLOCK_ALLOCATED
+#define MARK_UNLISTED(bp) set_block_flags((bp), 1, 0)
+#define LOCK(l)   lock_acquire(l)
+#define UNLOCK(l) lock_release(l)
+// Spins on a held lock before yielding the CPU
+#define LOCK_SPINS 64
+
+// A test-and-test-and-set lock, one cache line each; all zeros is unlocked
+typedef struct sf_lock {
+    int held;
+    char pad[64 - sizeof(int)];
+} sf_lock;
+#else
+#define TOP_CHUNK 0
+#define UNLISTED 0
+#define MARK_UNLISTED(bp) do { } while (0)
+#define LOCK(l)   do { } while (0)
+#define UNLOCK(l) do { } while (0)
+#endif
+
+/*
+ * Unlocked peek that lets the searches pass over an empty free list without taking its lock.
+ * With fine-grained locks a block pushed at that moment is only missed by this one search.
+ */
+#define LIST_EMPTY(head) (__atomic_load_n(&(head)->body.links.next, __ATOMIC_RELAXED) == (head))
+
+/* Element type of sf_quick_lists, which sfmm.h declares with an anonymous struct. */
+typedef __typeof__(sf_quick_lists[0]) sf_quick_list;
+
+typedef struct sf_segment {
+    struct sf_segment *next;    // Next segment of the same heap.
+    size_t size;                // Size of the whole segment, including this record.
+#ifdef SF_SIDE_TABLE
+    sf_side_table side;         // Keeps the prologue at 8 mod 16 after the record.
+#endif
+} sf_segment;
+
+/*
+ * All the state of one heap.  The default heap works on the sf_free_list_heads and
+ * sf_quick_lists globals declared in sfmm.h and grows through sf_mem_grow(); private
+ * heaps carry their own lists and grow by adding segments.
+ */
+struct sf_heap {
+    sf_block *free_list_heads;      // NUM_FREE_LISTS circular list headers.
+    sf_quick_list *quick_lists;     // NUM_QUICK_LISTS quick lists.
+    size_t alloc_flags;             // Flags stored in the header of every allocated block.
+    int initialized;
+#ifdef SF_FINE_LOCKS
+    char counters_pad[64];          // Keeps the counters every thread writes on lines of their own.
+#endif
+    size_t peak_payload_size;
+    size_t current_payload_size;
+#ifdef SF_FINE_LOCKS
+    char counters_pad_after[64];
+#endif
+    sf_segment *segments;           // Private heaps only.
+    sf_block *top;                  // Free block next to the epilogue; default heap only.
+    int placement;                  // SF_FIRST_FIT, SF_BEST_FIT or SF_ADDRESS_FIT.
+    int fit_candidates;             // Fitting blocks SF_BEST_FIT compares.
+    int colors;                     // Cache-line offsets large blocks rotate through; 0 is off.
+    size_t color_min;               // Smallest request that is colored.
+    size_t next_color;
+    struct sf_pheap_file *persist;  // File record of a persistent heap, which contains the heap.
+    sf_block own_free_list_heads[NUM_FREE_LISTS];
+    sf_quick_list own_quick_lists[NUM_QUICK_LISTS];
+#ifdef SF_FINE_LOCKS
+    sf_lock quick_locks[NUM_QUICK_LISTS];
+    sf_lock list_locks[NUM_FREE_LISTS];     // The last one also covers the top and expand_heap.
+    sf_lock init_lock;
+#endif
+};
+
+/*
+ * Start of the file of a persistent heap.  dirty is set, and on disk, before the first change
+ * after a flush, and cleared once a flush has written the change.
+ */
+typedef struct sf_pheap_file {
+    uint64_t magic;
+    size_t layout;                  // sizeof(sf_pheap_file) of the build that made the file.
+    char *base;                     // Address the file is mapped at.
+    size_t size;                    // Size of the file.
+    int dirty;                      // Lists may not match the blocks on disk.
+    sf_header key;                  // Header key the blocks are stored with.
+    int free_lists;                 // Free-list classes the lists were built with.
+    size_t class_bounds[NUM_FREE_LISTS];
+    size_t quick_limit;
+    void *root;
+    sf_heap_t heap;
+} sf_pheap_file;
+
+/* Address range of one private-heap segment, kept sorted by start address. */
+typedef struct sf_segment_range {
+    char *start;
+    char *end;
+    sf_heap_t *heap;
+} sf_segment_range;
+
+sf_heap_t sf_default_heap = { sf_free_list_heads, sf_quick_lists, THIS_BLOCK_ALLOCATED,
+                              .placement = SF_FIRST_FIT, .fit_candidates = BEST_FIT_CANDIDATES };
+#ifdef SF_META_HARDENED
+static sf_header sf_meta_key = 0;
+#endif
+#ifdef SF_SIDE_TABLE
+sf_side_table default_side;
+#endif
+
+/*
+ * Tunables, read once from the SFMM_CONF environment variable by load_config().
+ * The constants above and in sfmm.h are the defaults; the list counts can only
+ * be lowered, since the list headers themselves are declared in sfmm.h.
+ */
+typedef struct sf_config {
+    int loaded;
+    int quick_lists;            // Quick lists in use.
+    int quick_max;              // Length at which a quick list is flushed; 0 defers until a miss.
+    int free_lists;             // Free lists in use.
+    int class_min;              // Upper bound of the first free-list class.
+    int class_growth;           // Ratio between class bounds class_steps apart.
+    int class_steps;            // Classes per growth step.
+    int grow_pages;             // Pages expand_heap adds to the default heap at a time.
+    int placement;              // Policy for new heaps, or -1 to keep the default.
+    int fit_candidates;         // Candidates for SF_BEST_FIT, or 0 to keep the default.
+    int colors;                 // Colors for new heaps, or 0 to keep the default.
+    int color_min;              // Smallest colored request, or 0 for COLOR_MIN.
+    // Derived by load_config()
+    size_t quick_limit;         // Largest block size that goes to a quick list.
+    int quick_flush;            // quick_max, or INT_MAX if flushing is off.
+    size_t class_bounds[NUM_FREE_LISTS];
+} sf_config;
+
+/*
+ * Handle table.  A handle is an index into it; entry 0 is never used, so that 0 is not a
+ * valid handle.  Free entries are chained through next_free.  The block of a handle's object
+ * starts with the handle, in a DSIZE prefix that keeps the object aligned, so that compaction
+ * can tell a movable block from any other by checking that its entry points back at it.
+ */
+#define HANDLE_PREFIX DSIZE
+#define HANDLE_TABLE_MIN 64
+
+typedef struct sf_handle_entry {
+    void *object;               // Current address of the object; NULL if the entry is free.
+    size_t pins;
+    size_t next_free;
+} sf_handle_entry;
+
+sf_handle_entry *handle_table = NULL;
+size_t handle_capacity = 0;
+size_t handle_free = 0;         // First free entry; 0 if there is none.
+size_t compact_next = 1;        // Entry sf_hcompact looks at next.
+
+/*
+ * Lifetime hints.  Short- and long-lived objects are kept in private heaps of their own, so
+ * that the short-lived ones do not leave holes between long-lived ones and their segments
+ * empty out together.  For SF_AUTO_LIVED, every LIFETIME_SAMPLE_RATE-th allocation of a call
+ * site is sampled: its birth is taken from a clock that counts automatic allocations, and
+ * its lifetime is measured when it is freed, or found to be long when a newer sample needs
+ * its slot.  A site is short-lived once most of its samples died young.
+ */
+#define LIFETIME_SITES 256
+#define LIFETIME_SAMPLES 1024
+#define LIFETIME_SAMPLE_RATE 16
+#define LIFETIME_SHORT 4096         // Automatic allocations within which a short-lived sample dies.
+#define LIFETIME_DECAY 256          // Resolved samples at which a site's counts are halved.
+
+typedef struct sf_lifetime_site {
+    void *caller;
+    unsigned countdown;             // Allocations until the next sample.
+    unsigned short_lived;
+    unsigned long_lived;
+} sf_lifetime_site;
+
+typedef struct sf_lifetime_sample {
+    void *ptr;
+    sf_lifetime_site *site;
+    size_t birth;
+} sf_lifetime_sample;
+
+sf_heap_t lifetime_heaps[2];        // Short-lived, long-lived.
+pthread_once_t lifetime_once = PTHREAD_ONCE_INIT;
+sf_lifetime_site lifetime_sites[LIFETIME_SITES];
+sf_lifetime_sample lifetime_samples[LIFETIME_SAMPLES];
+size_t lifetime_clock = 0;
+size_t lifetime_pending = 0;      // Samples neither freed nor found long-lived yet.
+
+sf_config sf_conf = {
+    .quick_lists = NUM_QUICK_LISTS, .quick_max = 0, .free_lists = NUM_FREE_LISTS,
+    .class_min = SF_CLASS_MIN, .class_growth = SF_CLASS_GROWTH, .class_steps = SF_CLASS_STEPS,
+    .grow_pages = 1, .placement = -1, .fit_candidates = 0,
+    .quick_limit = MAX_QUICK_LIST_BLOCK_SIZE, .quick_flush = INT_MAX,
+    .class_bounds = SF_CLASS_BOUNDS,
+};
+// Free list of every block size up to CLASS_TABLE_LIMIT, indexed by size / 16
+unsigned char class_table[CLASS_TABLE_LIMIT / DSIZE + 1] = SF_CLASS_TABLE;
+
+sf_segment_range *segment_map = NULL;
+int segment_count = 0;
+int segment_capacity = 0;
 
-int heap_initialized = 0;
-double peak_payload_size = 0;
-double current_payload_size = 0;
+/*
+ * Queue of large blocks freed on the default heap while sf_async_free_start is in effect.
+ * It is a bounded ring in which every slot carries a sequence number, which tells producers
+ * that the slot is empty and the drainer that it has been filled: any number of threads
+ * enqueue with one compare-and-swap on tail, and the single drainer thread dequeues without
+ * one.  A queued block is marked allocated and quick, so that its neighbors leave it alone
+ * and freeing it again aborts; its size tells it apart from a real quick-list block.
+ */
+#define ASYNC_DEFAULT_DEPTH 1024
+// Blocks the drainer releases per acquisition of the caller's lock; producers wake it once a
+// batch is queued, and a smaller batch waits at most ASYNC_LINGER_NS for it
+#define ASYNC_BATCH 64
+#define ASYNC_LINGER_NS 5000000L
+// Values of sf_async.sleeping
+#define ASYNC_AWAKE 0
+#define ASYNC_LINGERING 1
+#define ASYNC_IDLE 2
+
+typedef struct sf_async_slot {
+    size_t seq;                 // Slot index when empty, one more once it holds bp.
+    sf_block *bp;
+} sf_async_slot;
+
+typedef struct sf_async {
+    int running;
+    int stopping;
+    int sleeping;               // ASYNC_LINGERING or ASYNC_IDLE while the drainer waits on wake.
+    sf_async_slot *slots;
+    size_t mask;                // Depth - 1.
+    void (*lock)(void *);
+    void (*unlock)(void *);
+    void *lock_arg;
+    pthread_t thread;
+    sem_t wake;
+    size_t drained;             // Blocks released so far, for sf_async_free_flush.
+    size_t head;                // Next slot to drain; drainer only.
+    char pad[64];
+    size_t tail;                // Next slot to fill; on a cache line of its own.
+    char pad2[64 - sizeof(size_t)];
+} sf_async;
+
+sf_async async_free;
 
 void initialize_heap();
-void expand_heap(size_t requested);
 void initialize_lists();
+void load_config();
+int parse_config(const char *conf);
+void build_class_bounds();
+void initialize_heap_lists(sf_heap_t *heap);
+void ensure_initialized(sf_heap_t *heap);
+int expand_heap(sf_heap_t *heap, size_t requested);
+int add_segment(sf_heap_t *heap, size_t requested);
+int register_segment(sf_segment *seg, char *end, sf_heap_t *heap);
+void unregister_segment(sf_segment *seg);
+sf_heap_t *heap_of_block(sf_block *bp);
+sf_segment_range *find_segment(void *p);
+void *heap_malloc(sf_heap_t *heap, size_t size);
+void heap_free(sf_heap_t *heap, void *pp);
+void *heap_realloc(sf_heap_t *heap, void *pp, size_t rsize);
+void *heap_memalign(sf_heap_t *heap, size_t alignment, size_t size);
+void track_payload(sf_heap_t *heap, size_t allocated, size_t freed);
 void set_block_meta_data(sf_block *bp, size_t payload, size_t size, size_t flags);
 void set_block_flags(sf_block *bp, int alloc, int quicklist);
 void create_epilogue();
 sf_block *get_prev_block(sf_block *bp);
 sf_block *get_next_block(sf_block *bp);
-sf_block *coalesce(sf_block *bp);
-sf_block *split_block(sf_block *bp, size_t split_size, size_t payload_size);
-sf_block *search_free_list_for_block(size_t requested);
-void insert_free_list(sf_block *bp, int index);
+sf_block *coalesce(sf_heap_t *heap, sf_block *bp);
+sf_block *claim_neighbor(sf_heap_t *heap, sf_block *bp, int after);
+sf_block *free_prev_block(sf_block *bp);
+sf_block *free_next_block(sf_block *bp);
+sf_block *split_block(sf_heap_t *heap, sf_block *bp, size_t split_size, size_t payload_size);
+sf_block *search_free_list_for_block(sf_heap_t *heap, size_t requested);
+sf_block *search_best_fit(sf_heap_t *heap, size_t requested);
+sf_block *find_free_block(sf_heap_t *heap, size_t requested);
+sf_block *take_free_block(sf_heap_t *heap, sf_block *bp, size_t requested);
+sf_block *carve_top(sf_heap_t *heap, size_t size);
+size_t block_color(sf_heap_t *heap, size_t size, size_t block_size);
+void set_top(sf_heap_t *heap, sf_block *bp);
+void release_block(sf_heap_t *heap, sf_block *bp);
+int consolidate(sf_heap_t *heap);
+void insert_free_list(sf_heap_t *heap, sf_block *bp, int index);
 void remove_from_free_list(sf_block *bp);
-void insert_quick_list(sf_block *bp, int index);
-sf_block *pop_quick_list(int index);
-int freelist_index(int n);
+void insert_quick_list(sf_heap_t *heap, sf_block *bp, int index);
+sf_block *pop_quick_list(sf_heap_t *heap, int index);
+void leave_quick_list(sf_block *bp);
+int freelist_index(size_t n);
 int quicklist_index(int n);
 size_t calculate_block_size(size_t size);
 int valid_pointer(sf_block *p);
+int valid_block(sf_block *bp);
+int handle_grow();
+sf_handle_entry *handle_entry(sf_handle_t h);
+size_t handle_move(sf_heap_t *heap, sf_handle_entry *entry);
+sf_block *lowest_fit(sf_heap_t *heap, size_t size, sf_block *limit);
+void initialize_private_heap(sf_heap_t *heap);
+size_t release_empty_segments(sf_heap_t *heap);
+size_t discard_free_pages(sf_block *bp);
+sf_heap_t *lifetime_heap(int hint);
+void lifetime_init();
+sf_lifetime_site *lifetime_site(void *caller);
+int lifetime_is_short(sf_lifetime_site *site);
+void lifetime_sample(void *pp, sf_lifetime_site *site);
+void lifetime_resolve(sf_lifetime_sample *sample);
+void lifetime_free(void *pp);
+int near_page(sf_block *bp, sf_block *hint);
+sf_block *near_quick_block(sf_heap_t *heap, sf_block *hint, size_t block_size);
+sf_block *near_neighbor_block(sf_heap_t *heap, sf_block *hint, size_t block_size, size_t size);
+sf_block *near_free_block(sf_heap_t *heap, sf_block *hint, size_t block_size);
+int dump_state(sf_heap_t *heap, sf_block *bp);
+int dump_write(int fd, const void *buf, size_t size);
+sf_pheap_file *pheap_map(const char *path, size_t size, char *base, int *created);
+int pheap_rebuild(sf_pheap_file *file);
+void pheap_mark_dirty(sf_heap_t *heap);
+int pheap_same_classes(sf_pheap_file *file);
+void pheap_save_classes(sf_pheap_file *file);
+int async_free_defer(sf_block *bp);
+int async_free_push(sf_block *bp);
+int async_free_pop(sf_block **batch);
+int async_free_ready();
+void async_free_wake(int urgent);
+void async_free_sleep();
+void *async_free_drainer(void *arg);
+#ifdef SF_FINE_LOCKS
+int free_list_of(sf_block *bp);
+void lock_acquire(sf_lock *lock);
+void lock_release(sf_lock *lock);
+#endif
+#ifdef SF_SIDE_TABLE
+void side_table_init(sf_side_table *side, char *base, uint64_t *words, size_t words_size);
+sf_side_table *side_table_of(void *p);
+void side_mark(void *hp, size_t size, int alloc);
+size_t side_block_size(void *hp);
+void side_set_alloc(void *hp, int alloc);
+size_t side_next_start(sf_side_table *side, size_t g);
+size_t side_prev_start(sf_side_table *side, size_t g);
+#endif
 
 
 
 void *sf_malloc(size_t size) {
-
-    if (!heap_initialized){
-        initialize_lists();
-        initialize_heap();
-        heap_initialized = 1;
-    }
-
-    if (size <= 0){
-        return NULL;
-    }
-
-    size_t block_size = calculate_block_size(size);
-
-    // First, check quicklist
-    if (block_size <= MAX_QUICK_LIST_BLOCK_SIZE){
-        int q_index = quicklist_index(block_size);
-        sf_block *bp = pop_quick_list(q_index);
-        if (bp){
-            //size_t size = GET_PAYLOAD(bp->header);
-            set_block_meta_data(bp, size, block_size, THIS_BLOCK_ALLOCATED);
-            // No need to split; exactly the requested size
-
-            // Tracking current payload; update max payload in lifetime
-            current_payload_size += size;
-            if (current_payload_size > peak_payload_size) {
-                peak_payload_size = current_payload_size;
-            }
-
-            return (void *)((char *)bp + sizeof(sf_header));
-        }
-    }
-
-    // If too large or not found in quicklist, search in free_list
-    sf_block *bp = search_free_list_for_block(block_size);
-    // If no available block found, expand heap
-    if (!bp){
-        expand_heap(block_size);
-        bp = search_free_list_for_block(block_size);
-        // Still not found; out of memory
-        if (!bp){
-            sf_errno = ENOMEM;
-            return NULL; 
-        }
-    }
-
-    // Check if we can split bp to avoid splinters
-    size_t actual_size = GET_SIZE(&(bp->header));
-    if (actual_size - block_size >= MIN_BLOCK_SIZE){
-        bp = split_block(bp, block_size, size);
-    } else {
-        remove_from_free_list(bp);
-        set_block_meta_data(bp, size, actual_size, THIS_BLOCK_ALLOCATED);
-    }
-
-    // Tracking current payload; update max payload in lifetime
-    current_payload_size += size;
-    if (current_payload_size > peak_payload_size) {
-        peak_payload_size = current_payload_size;
-    }
-
-    return (void *)((char *)bp + sizeof(sf_header));
+    return heap_malloc(&sf_default_heap, size);
 }
 
 void sf_free(void *pp) {
@@ -130,30 +532,7 @@ void sf_free(void *pp) {
     }
 
     sf_block *bp = (sf_block *)((char *)pp - sizeof(sf_header));
-
-    if (!IS_ALLOCATED(&(bp->header)) || IS_IN_QUICK_LIST(&(bp->header))) {
-        abort();
-    }
-
-    // Tracking current payload; remove payload amount from the freed block
-    size_t freed_payload = GET_PAYLOAD(&(bp->header));
-    current_payload_size -= freed_payload;
-
-    // Get block size
-    size_t block_size = GET_SIZE(&(bp->header));
-
-    // Insert into quicklist for delayed coalesce if small block
-    if (block_size <= MAX_QUICK_LIST_BLOCK_SIZE){
-        set_block_meta_data(bp, 0 , block_size, IN_QUICK_LIST | THIS_BLOCK_ALLOCATED);
-        int q_index = quicklist_index(block_size);
-        insert_quick_list(bp, q_index);
-    } else { // Coalesce and then insert into respective list if large block
-        set_block_meta_data(bp, 0, block_size, 0);
-        bp = coalesce(bp);
-
-        int index = freelist_index(GET_SIZE(&(bp->header)));
-        insert_free_list(bp, index);
-    }
+    heap_free(heap_of_block(bp), pp);
 }
 
 void *sf_realloc(void *pp, size_t rsize) {
@@ -165,77 +544,75 @@ void *sf_realloc(void *pp, size_t rsize) {
         sf_free(pp);
         return NULL;
     }
-    if (valid_pointer(pp) == 0){
+    if (pp == NULL || valid_pointer((sf_block *)((char *)pp - sizeof(sf_header))) == 0){
+        sf_errno = EINVAL;
         return NULL;
     }
 
     sf_block *bp = (sf_block *)((char *)pp - sizeof(sf_header));
+    return heap_realloc(heap_of_block(bp), pp, rsize);
+}
 
-    size_t old_size = GET_SIZE(&(bp->header));
-
-    size_t block_size = calculate_block_size(rsize);
-    size_t old_payload_size = GET_PAYLOAD(&(bp->header));
-
-    if (block_size > old_size){
-        // Larger size requested; adjust malloc bytes to remove overhead
-        void *ptr = sf_malloc(block_size - sizeof(sf_header) - sizeof(sf_footer));
-
-        if (ptr == NULL){
-            // out of memory
-            return NULL;
-        }
-
-        // -16 gets rid of the header/footer overhead in size
-        memcpy(ptr, pp, old_size - 16);
-
-        // Free the old ptr
-        sf_free(pp);
-
-        return ptr;
-    } 
-
-    // Smaller size requested; shrinking the block
-    if (old_size - block_size >= MIN_BLOCK_SIZE){
-        // Split the block
-
-        // Set the new header / footer
-        set_block_meta_data(bp, rsize, block_size, THIS_BLOCK_ALLOCATED);
-
-        // Track current payload; shrink the payload
-        current_payload_size -= old_payload_size;
-        current_payload_size += rsize;
-
-        // The left over becomes a new free block
-        sf_block *remain = (sf_block *)((char *)bp + block_size);
-        set_block_meta_data(remain, 0, (old_size-block_size), 0);
-
-        // Coalesce and insert into appropriate free list
-        remain = coalesce(remain);
-        int index = freelist_index(GET_SIZE(&(remain->header)));
-        insert_free_list(remain, index);
-
-        return pp;
+void *sf_memalign(size_t alignment, size_t size) {
+    return heap_memalign(&sf_default_heap, alignment, size);
+}
 
-    } else {
+size_t sf_malloc_usable_size(void *pp) {
+    if (pp == NULL){
+        return 0;
+    }
+    sf_block *bp = (sf_block *)((char *)pp - sizeof(sf_header));
+    if (!IS_ALLOCATED(&(bp->header)) || IS_IN_QUICK_LIST(&(bp->header))){
+        return 0;
+    }
+    // Everything between the header and the footer belongs to the caller
+    return GET_SIZE(&(bp->header)) - BLOCK_OVERHEAD;
+}
 
-        // Track current payload; shrink the payload
-        current_payload_size -= old_payload_size;
-        current_payload_size += rsize;
+size_t sf_good_size(size_t size) {
+    if (size == 0 || size > MAX_PAYLOAD_SIZE){
+        return 0;
+    }
+    return calculate_block_size(size) - BLOCK_OVERHEAD;
+}
 
-        // Keep the splinter
-        return pp;
+sf_sized_ptr_t sf_malloc_sized(size_t size) {
+    sf_sized_ptr_t result = { heap_malloc(&sf_default_heap, size), 0 };
+    if (result.ptr == NULL){
+        return result;
     }
+    sf_block *bp = (sf_block *)((char *)result.ptr - sizeof(sf_header));
+    size_t block_size = GET_SIZE(&(bp->header));
+    result.size = block_size - BLOCK_OVERHEAD;
+    // The caller is told it owns the whole block, so count all of it as payload
+    set_block_meta_data(bp, result.size, block_size, sf_default_heap.alloc_flags);
+    track_payload(&sf_default_heap, result.size, size);
+    return result;
 }
 
 double sf_fragmentation() {
 
-    if (!heap_initialized){
+    if (!sf_default_heap.initialized){
         return 0;
     }
 
-    double total_block_size = 0;  
+    double total_block_size = 0;
     double total_allocated_payloads = 0;
 
+#ifdef SF_SIDE_TABLE
+    // Free blocks are stepped over in the side table without reading their headers
+    sf_side_table *side = &default_side;
+    size_t end = SIDE_GRANULE(side, (char *)sf_mem_end() - 8);
+    size_t g = side_next_start(side, 0);
+    while (g < end){
+        size_t next = side_next_start(side, g);
+        if (SIDE_ALLOC(side, g) & SIDE_BIT(g)){
+            total_allocated_payloads += GET_PAYLOAD(side->base + g * DSIZE);
+            total_block_size += (next - g) * DSIZE;
+        }
+        g = next;
+    }
+#else
     sf_block *current = (sf_block *)((char *)sf_mem_start() + 40);
 
     while ((char *)current < (char *)sf_mem_end() - 8){
@@ -256,6 +633,7 @@ double sf_fragmentation() {
         // Go to next block
         current = (sf_block *)next_address;
     }
+#endif
 
     if (total_allocated_payloads == 0){ // no allocated blocks, return 0
         return 0;
@@ -266,322 +644,2680 @@ double sf_fragmentation() {
 
 double sf_utilization() {
 
-    if (!heap_initialized){
+    if (!sf_default_heap.initialized){
         return 0;
     }
     double heap_size = (double)((char *)sf_mem_end() - (char *)sf_mem_start());
 
-    return (double)peak_payload_size / heap_size;
+    return (double)sf_default_heap.peak_payload_size / heap_size;
 }
 
 /*
-    End of required functions to implement;
-    Start of helper functions
+    Private heaps
 */
 
-void initialize_heap(){
-    char *heap_start = (char *)sf_mem_grow();
-    // Reserve 8 byte padding for alignment
-    sf_block *prologue = (sf_block *)(heap_start + 8);
-
-    // Build prologue
-    set_block_meta_data(prologue, 0, MIN_BLOCK_SIZE, THIS_BLOCK_ALLOCATED);
-
-    // Find size of free block
-    // free block size = page size - padding - prologue - epilogue
-    size_t free_size = PAGE_SZ - WSIZE - MIN_BLOCK_SIZE - WSIZE;
+sf_heap_t *sf_heap_create(void) {
+    sf_heap_t *heap = heap_malloc(&sf_default_heap, sizeof(sf_heap_t));
+    if (heap == NULL){
+        return NULL;
+    }
+    initialize_private_heap(heap);
+    return heap;
+}
 
-    // Build one giant free block
-    sf_block *free_block = (sf_block *)((char *)prologue + MIN_BLOCK_SIZE);
-    set_block_meta_data(free_block, 0, free_size, 0);
+void sf_heap_destroy(sf_heap_t *heap) {
+    // A persistent heap is closed with sf_pheap_close instead
+    if (heap == NULL || heap == &sf_default_heap || heap->persist != NULL){
+        return;
+    }
+    // Every block of the heap lives in one of its segments, so releasing them is enough
+    sf_segment *seg = heap->segments;
+    while (seg != NULL){
+        sf_segment *next = seg->next;
+        unregister_segment(seg);
+#ifdef SF_SIDE_TABLE
+        heap_free(&sf_default_heap, seg->side.words);
+#endif
+        heap_free(&sf_default_heap, seg);
+        seg = next;
+    }
+    heap_free(&sf_default_heap, heap);
+}
 
-    // Place block in free_list
-    int index = freelist_index(free_size);
-    insert_free_list(free_block, index);
+void *sf_heap_malloc(sf_heap_t *heap, size_t size) {
+    return heap_malloc(heap ? heap : &sf_default_heap, size);
+}
 
-    // Build epilogue
-    create_epilogue();
+void sf_heap_free(sf_heap_t *heap, void *ptr) {
+    if (ptr == NULL){
+        abort();
+    }
+    if (heap == NULL){
+        heap = &sf_default_heap;
+    }
+    META_CHECK(heap_of_block((sf_block *)((char *)ptr - sizeof(sf_header))) == heap);
+    heap_free(heap, ptr);
 }
 
-void expand_heap(size_t requested){
-    size_t total = 0;
+void *sf_heap_realloc(sf_heap_t *heap, void *ptr, size_t size) {
+    if (ptr == NULL){
+        return sf_heap_malloc(heap, size);
+    }
+    if (size == 0){
+        sf_heap_free(heap, ptr);
+        return NULL;
+    }
+    if (valid_pointer((sf_block *)((char *)ptr - sizeof(sf_header))) == 0){
+        sf_errno = EINVAL;
+        return NULL;
+    }
+    return heap_realloc(heap ? heap : &sf_default_heap, ptr, size);
+}
 
-    while (total < requested){
-        sf_block *old_epilogue = (sf_block *)((char *)sf_mem_end() - 8);
+void *sf_heap_memalign(sf_heap_t *heap, size_t alignment, size_t size) {
+    return heap_memalign(heap ? heap : &sf_default_heap, alignment, size);
+}
 
-        if (sf_mem_grow() == NULL) {
-            sf_errno = ENOMEM;
-            return;
+int sf_heap_set_placement(sf_heap_t *heap, int policy, int candidates) {
+    if (heap == NULL){
+        heap = &sf_default_heap;
+    }
+    if ((policy != SF_FIRST_FIT && policy != SF_BEST_FIT && policy != SF_ADDRESS_FIT)
+        || candidates < 0){
+        sf_errno = EINVAL;
+        return -1;
+    }
+    heap->fit_candidates = candidates ? candidates : BEST_FIT_CANDIDATES;
+    if (policy == heap->placement){
+        return 0;
+    }
+    heap->placement = policy;
+
+    // Address order only holds if every list is sorted, so relink what is already there.
+    // The top chunk keeps its flag and its place at the tail of the last list.
+    if (policy == SF_ADDRESS_FIT && heap->initialized){
+        for (int i = 0; i<NUM_FREE_LISTS; i++){
+            sf_block *head = &(heap->free_list_heads[i]);
+            sf_block *current = head->body.links.next;
+            head->body.links.next = head;
+            head->body.links.prev = head;
+            while (current != head){
+                sf_block *next = current->body.links.next;
+                if (current != heap->top){
+                    insert_free_list(heap, current, i);
+                }
+                current = next;
+            }
+        }
+        if (heap->top != NULL){
+            LOCK(&heap->list_locks[sf_conf.free_lists - 1]);
+            set_top(heap, heap->top);
+            UNLOCK(&heap->list_locks[sf_conf.free_lists - 1]);
         }
+    }
+    return 0;
+}
 
-        total += PAGE_SZ;
+int sf_heap_set_coloring(sf_heap_t *heap, int colors, size_t min_size) {
+    if (heap == NULL){
+        heap = &sf_default_heap;
+    }
+    if (colors < 0 || colors > MAX_COLORS){
+        sf_errno = EINVAL;
+        return -1;
+    }
+    heap->colors = colors;
+    heap->color_min = min_size ? min_size : COLOR_MIN;
+    return 0;
+}
 
-        char *new_end = (char *)sf_mem_end();  
-        size_t block_size = new_end - (char *)old_epilogue;
-        set_block_meta_data(old_epilogue, 0, block_size, 0);
+/*
+    Persistent heaps
+*/
 
-        sf_block *coalesced = coalesce(old_epilogue);
+sf_heap_t *sf_pheap_open(const char *path, size_t size, void *base) {
+#ifdef SF_SIDE_TABLE
+    // The side table of a segment lives outside it and would not survive a restart
+    sf_errno = ENOTSUP;
+    return NULL;
+#else
+    int created = 0;
+    sf_pheap_file *file = pheap_map(path, size, base ? (char *)base : PHEAP_BASE, &created);
+    if (file == NULL){
+        return NULL;
+    }
+    // The default heap sets the header key; a process that opens its persistent heap
+    // before the first allocation adopts the key of the file and saves a rebuild
+    if (!created && !sf_default_heap.initialized){
+        sf_set_magic(file->key);
+    }
+    ensure_initialized(&sf_default_heap);
+
+    sf_heap_t *heap = &(file->heap);
+    sf_segment *seg = PHEAP_SEGMENT(file);
+    sf_block *prologue = (sf_block *)((char *)seg + SEGMENT_PROLOGUE_OFFSET);
+
+    if (created){
+        file->magic = PHEAP_MAGIC;
+        file->layout = sizeof(sf_pheap_file);
+        file->base = (char *)file;
+        file->root = NULL;
+        initialize_private_heap(heap);
+        heap->persist = file;
+        seg->next = NULL;
+        seg->size = file->size - ((char *)seg - (char *)file);
+
+        // Same layout as a segment: prologue, one free block, epilogue
+        set_block_meta_data(prologue, 0, MIN_BLOCK_SIZE, THIS_BLOCK_ALLOCATED);
+        sf_block *free_block = (sf_block *)((char *)prologue + MIN_BLOCK_SIZE);
+        size_t free_size = seg->size - SEGMENT_OVERHEAD;
+        set_block_meta_data(free_block, 0, free_size, UNLISTED);
+        insert_free_list(heap, free_block, freelist_index(free_size));
+        PUT(file->base + file->size - WSIZE, THIS_BLOCK_ALLOCATED);
+    }
+    if (register_segment(seg, file->base + file->size, heap) != 0){
+        munmap(file->base, file->size);
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+#ifdef SF_FINE_LOCKS
+    // Whatever state the locks were left in by the last process
+    memset(heap->quick_locks, 0, sizeof(heap->quick_locks));
+    memset(heap->list_locks, 0, sizeof(heap->list_locks));
+    memset(&heap->init_lock, 0, sizeof(heap->init_lock));
+#endif
+
+    heap->initialized = 1;
+    // A crash, another header key or other size classes leave lists that cannot be trusted
+    if (!created && (file->dirty || file->key != META_KEY || !pheap_same_classes(file))){
+        pheap_mark_dirty(heap);
+        if (pheap_rebuild(file) != 0){
+            unregister_segment(seg);
+            munmap(file->base, file->size);
+            sf_errno = EIO;
+            return NULL;
+        }
+    } else if (!created){
+        // Mapped and ready
+        return heap;
+    }
+    // A new or rebuilt heap is written out before it is used
+    file->dirty = 1;
+    file->key = META_KEY;
+    pheap_save_classes(file);
+    if (sf_pheap_flush(heap) != 0){
+        sf_pheap_close(heap);
+        return NULL;
+    }
+    return heap;
+#endif
+}
 
-        total = GET_SIZE(&(coalesced->header));
+int sf_pheap_flush(sf_heap_t *heap) {
+    if (heap == NULL || heap->persist == NULL){
+        sf_errno = EINVAL;
+        return -1;
+    }
+    sf_pheap_file *file = heap->persist;
+    if (!file->dirty){
+        // Nothing changed since the last flush
+        return 0;
+    }
+    // The blocks and lists first, then the flag that vouches for them
+    if (msync(file->base, file->size, MS_SYNC) != 0){
+        sf_errno = errno;
+        return -1;
+    }
+    // The next change marks the file dirty again before it is made
+    file->dirty = 0;
+    if (msync(file->base, PAGE_SZ, MS_SYNC) != 0){
+        sf_errno = errno;
+        return -1;
+    }
+    return 0;
+}
 
-        int index = freelist_index(total);
-        insert_free_list(coalesced, index);
+int sf_pheap_close(sf_heap_t *heap) {
+    if (heap == NULL || heap->persist == NULL){
+        sf_errno = EINVAL;
+        return -1;
+    }
+    sf_pheap_file *file = heap->persist;
+    int result = sf_pheap_flush(heap);
+    unregister_segment(PHEAP_SEGMENT(file));
+    munmap(file->base, file->size);
+    return result;
+}
 
-        create_epilogue();
+void *sf_pheap_root(sf_heap_t *heap) {
+    if (heap == NULL || heap->persist == NULL){
+        return NULL;
     }
+    return heap->persist->root;
 }
 
-void initialize_lists(){
-    for (int i = 0; i<NUM_QUICK_LISTS; i++){
-        sf_quick_lists[i].length = 0;
-        sf_quick_lists[i].first = NULL;
+int sf_pheap_set_root(sf_heap_t *heap, void *root) {
+    if (heap == NULL || heap->persist == NULL){
+        sf_errno = EINVAL;
+        return -1;
     }
-    for (int j = 0; j<NUM_FREE_LISTS; j++){
-        sf_free_list_heads[j].body.links.next = &(sf_free_list_heads[j]);
-        sf_free_list_heads[j].body.links.prev = &(sf_free_list_heads[j]);
+    sf_pheap_file *file = heap->persist;
+    if (root != NULL && ((char *)root < file->base || (char *)root >= file->base + file->size)){
+        sf_errno = EINVAL;
+        return -1;
     }
+    ensure_initialized(heap);
+    file->root = root;
+    return 0;
 }
 
-/**
- * Sets up the header and footer for a block at pointer bp
- * with the given size and flags
- */
-
-void set_block_meta_data(sf_block *bp, size_t payload, size_t size, size_t flags) {
-    // Create value that goes into header / footer
-    size_t value = (payload << 32) | size | flags;
+/*
+    Handles
+*/
 
-    // Write the header
-    PUT(&(bp->header), value);
+sf_handle_t sf_halloc(size_t size) {
+    if (size == 0){
+        return 0;
+    }
+    if (size > MAX_PAYLOAD_SIZE - HANDLE_PREFIX){
+        sf_errno = ENOMEM;
+        return 0;
+    }
+    if (handle_free == 0 && handle_grow() != 0){
+        return 0;
+    }
+    char *payload = heap_malloc(&sf_default_heap, size + HANDLE_PREFIX);
+    if (payload == NULL){
+        return 0;
+    }
+    sf_handle_t h = handle_free;
+    handle_free = handle_table[h].next_free;
+    *(sf_handle_t *)payload = h;
+    handle_table[h].object = payload + HANDLE_PREFIX;
+    handle_table[h].pins = 0;
+    return h;
+}
 
-    // Compute footer address
-    char *footer_addr = (char *)bp + size - WSIZE;
+void *sf_hpin(sf_handle_t h) {
+    sf_handle_entry *entry = handle_entry(h);
+    entry->pins++;
+    return entry->object;
+}
 
-    // Write the footer
-    PUT(footer_addr, value);
+void sf_hunpin(sf_handle_t h) {
+    sf_handle_entry *entry = handle_entry(h);
+    if (entry->pins == 0){
+        abort();
+    }
+    entry->pins--;
+}
+
+void sf_hfree(sf_handle_t h) {
+    sf_handle_entry *entry = handle_entry(h);
+    // Someone still holds its address
+    if (entry->pins != 0){
+        abort();
+    }
+    heap_free(&sf_default_heap, (char *)entry->object - HANDLE_PREFIX);
+    entry->object = NULL;
+    entry->next_free = handle_free;
+    handle_free = h;
+}
+
+size_t sf_hcompact(size_t budget) {
+    sf_heap_t *heap = &sf_default_heap;
+    if (!heap->initialized || handle_capacity <= 1){
+        return 0;
+    }
+    // Holes in the quick lists only count once they are free blocks
+    consolidate(heap);
+
+    size_t moved = 0;
+    for (size_t n = 1; n < handle_capacity; n++){
+        if (compact_next == 0 || compact_next >= handle_capacity){
+            compact_next = 1;
+        }
+        sf_handle_entry *entry = &handle_table[compact_next++];
+        if (entry->object != NULL && entry->pins == 0){
+            moved += handle_move(heap, entry);
+            if (budget != 0 && moved >= budget){
+                break;
+            }
+        }
+    }
+    return moved;
+}
+
+size_t sf_trim(void) {
+    sf_heap_t *heap = &sf_default_heap;
+    if (!heap->initialized){
+        return 0;
+    }
+    // Segments of the lifetime heaps that emptied out go back to the default heap first
+    for (int i = 0; i < 2; i++){
+        if (lifetime_heaps[i].initialized){
+            release_empty_segments(&lifetime_heaps[i]);
+        }
+    }
+    consolidate(heap);
+    size_t released = 0;
+    for (int i = 0; i < sf_conf.free_lists; i++){
+        sf_block *head = &(heap->free_list_heads[i]);
+        LOCK(&heap->list_locks[i]);
+        for (sf_block *bp = head->body.links.next; bp != head; bp = bp->body.links.next){
+            released += discard_free_pages(bp);
+        }
+        UNLOCK(&heap->list_locks[i]);
+    }
+    return released;
+}
+
+/*
+    Lifetime hints
+*/
+
+void *sf_malloc_hint(size_t size, int hint) {
+    if (hint == SF_AUTO_LIVED){
+        sf_lifetime_site *site = lifetime_site(__builtin_return_address(0));
+        lifetime_clock++;
+        hint = site != NULL && lifetime_is_short(site) ? SF_SHORT_LIVED : SF_LONG_LIVED;
+        void *pp = heap_malloc(lifetime_heap(hint), size);
+        if (pp != NULL && site != NULL && site->countdown-- == 0){
+            site->countdown = LIFETIME_SAMPLE_RATE - 1;
+            lifetime_sample(pp, site);
+        }
+        return pp;
+    }
+    if (hint != SF_SHORT_LIVED && hint != SF_LONG_LIVED){
+        sf_errno = EINVAL;
+        return NULL;
+    }
+    return heap_malloc(lifetime_heap(hint), size);
+}
+
+/*
+    Locality hints
+*/
+
+void *sf_malloc_near(void *hint, size_t size) {
+    if (hint == NULL){
+        return heap_malloc(&sf_default_heap, size);
+    }
+    sf_block *hb = (sf_block *)((char *)hint - sizeof(sf_header));
+    META_CHECK(valid_block(hb) && IS_ALLOCATED(&(hb->header)) && !IS_IN_QUICK_LIST(&(hb->header)));
+    sf_heap_t *heap = heap_of_block(hb);
+    ensure_initialized(heap);
+    if (size == 0 || size > MAX_PAYLOAD_SIZE){
+        return heap_malloc(heap, size);
+    }
+
+    size_t block_size = calculate_block_size(size);
+    sf_block *bp = NULL;
+    if (block_size <= sf_conf.quick_limit){
+        bp = near_quick_block(heap, hb, block_size);
+    }
+    if (bp != NULL){
+        set_block_meta_data(bp, size, block_size, heap->alloc_flags);
+    } else if ((bp = near_neighbor_block(heap, hb, block_size, size)) == NULL){
+        if ((bp = near_free_block(heap, hb, block_size)) == NULL){
+            return heap_malloc(heap, size);
+        }
+        if (GET_SIZE(&(bp->header)) - block_size >= MIN_BLOCK_SIZE){
+            bp = split_block(heap, bp, block_size, size);
+        } else {
+            set_block_meta_data(bp, size, GET_SIZE(&(bp->header)), heap->alloc_flags);
+        }
+    }
+    track_payload(heap, size, 0);
+    return (void *)((char *)bp + sizeof(sf_header));
+}
+
+/*
+    Heap snapshots
+*/
+
+int sf_heap_dump(int fd) {
+    sf_heap_t *heap = &sf_default_heap;
+    sf_dump_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SF_DUMP_MAGIC, sizeof(header.magic));
+    header.version = SF_DUMP_VERSION;
+    header.record_size = sizeof(sf_dump_record);
+    header.page_size = PAGE_SZ;
+    header.heap_start = (uintptr_t)sf_mem_start();
+    header.heap_size = (char *)sf_mem_end() - (char *)sf_mem_start();
+
+    // Blocks run from after the prologue to the epilogue; there are none before initialization
+    sf_block *end = (sf_block *)((char *)sf_mem_end() - 8);
+    sf_block *first = heap->initialized ? (sf_block *)((char *)sf_mem_start() + 40) : end;
+    for (sf_block *bp = first; bp < end; bp = (sf_block *)((char *)bp + GET_SIZE(&(bp->header)))){
+        header.blocks++;
+    }
+    if (dump_write(fd, &header, sizeof(header)) != 0){
+        return -1;
+    }
+
+    sf_dump_record batch[DUMP_BATCH];
+    int n = 0;
+    for (sf_block *bp = first; bp < end; bp = (sf_block *)((char *)bp + GET_SIZE(&(bp->header)))){
+        sf_dump_record *rec = &batch[n++];
+        memset(rec, 0, sizeof(*rec));
+        rec->offset = (char *)bp - (char *)sf_mem_start();
+        rec->size = GET_SIZE(&(bp->header));
+        rec->state = dump_state(heap, bp);
+        rec->payload = rec->state == SF_DUMP_ALLOCATED ? GET_PAYLOAD(&(bp->header)) : 0;
+        rec->size_class = freelist_index(rec->size);
+        if (n == DUMP_BATCH){
+            if (dump_write(fd, batch, n * sizeof(sf_dump_record)) != 0){
+                return -1;
+            }
+            n = 0;
+        }
+    }
+    return dump_write(fd, batch, n * sizeof(sf_dump_record));
+}
+
+/*
+    Asynchronous free
+*/
+
+int sf_async_free_start(size_t depth, void (*lock)(void *), void (*unlock)(void *), void *arg) {
+    if (depth == 0){
+        depth = ASYNC_DEFAULT_DEPTH;
+    }
+    if (async_free.running || (depth & (depth - 1)) != 0 || (lock == NULL) != (unlock == NULL)){
+        sf_errno = EINVAL;
+        return -1;
+    }
+#ifndef SF_FINE_LOCKS
+    // The thread releases blocks while the caller keeps allocating, so the two need a lock
+    if (lock == NULL){
+        sf_errno = EINVAL;
+        return -1;
+    }
+#endif
+    if (depth > MAX_PAYLOAD_SIZE / sizeof(sf_async_slot)){
+        sf_errno = ENOMEM;
+        return -1;
+    }
+    sf_async_slot *slots = heap_malloc(&sf_default_heap, depth * sizeof(sf_async_slot));
+    if (slots == NULL){
+        return -1;
+    }
+    for (size_t i = 0; i < depth; i++){
+        slots[i].seq = i;
+        slots[i].bp = NULL;
+    }
+    async_free.slots = slots;
+    async_free.mask = depth - 1;
+    async_free.lock = lock;
+    async_free.unlock = unlock;
+    async_free.lock_arg = arg;
+    async_free.stopping = 0;
+    async_free.sleeping = 0;
+    async_free.drained = 0;
+    async_free.head = 0;
+    async_free.tail = 0;
+
+    int err = 0;
+    if (sem_init(&async_free.wake, 0, 0) != 0){
+        err = errno;
+    } else if ((err = pthread_create(&async_free.thread, NULL, async_free_drainer, NULL)) != 0){
+        sem_destroy(&async_free.wake);
+    }
+    if (err != 0){
+        heap_free(&sf_default_heap, slots);
+        sf_errno = err;
+        return -1;
+    }
+    __atomic_store_n(&async_free.running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void sf_async_free_flush(void) {
+    if (!__atomic_load_n(&async_free.running, __ATOMIC_ACQUIRE)){
+        return;
+    }
+    while (__atomic_load_n(&async_free.drained, __ATOMIC_ACQUIRE)
+           != __atomic_load_n(&async_free.tail, __ATOMIC_ACQUIRE)){
+        async_free_wake(1);
+        sched_yield();
+    }
+}
+
+void sf_async_free_stop(void) {
+    if (!async_free.running){
+        return;
+    }
+    // Frees from here on are done inline, so only what is queued is left to drain
+    __atomic_store_n(&async_free.running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&async_free.stopping, 1, __ATOMIC_RELEASE);
+    async_free_wake(1);
+    pthread_join(async_free.thread, NULL);
+    sem_destroy(&async_free.wake);
+    heap_free(&sf_default_heap, async_free.slots);
+    async_free.slots = NULL;
+}
+
+/*
+    End of required functions to implement;
+    Start of helper functions
+*/
+
+void *heap_malloc(sf_heap_t *heap, size_t size) {
+    SF_PROBE1(malloc_entry, size);
+
+    ensure_initialized(heap);
+
+    if (size <= 0){
+        SF_PROBE3(malloc_exit, NULL, size, 0);
+        return NULL;
+    }
+
+    if (size > MAX_PAYLOAD_SIZE){
+        sf_errno = ENOMEM;
+        SF_PROBE3(malloc_exit, NULL, size, 0);
+        return NULL;
+    }
+
+    size_t block_size = calculate_block_size(size);
+
+    // First, check quicklist
+    if (block_size <= sf_conf.quick_limit){
+        int q_index = quicklist_index(block_size);
+        sf_block *bp = pop_quick_list(heap, q_index);
+        if (bp){
+            SF_PROBE2(quick_hit, bp, block_size);
+            //size_t size = GET_PAYLOAD(bp->header);
+            set_block_meta_data(bp, size, block_size, heap->alloc_flags);
+            // No need to split; exactly the requested size
+
+            track_payload(heap, size, 0);
+            SF_PROBE3(malloc_exit, (char *)bp + sizeof(sf_header), size, block_size);
+            return (void *)((char *)bp + sizeof(sf_header));
+        }
+        SF_PROBE1(quick_miss, block_size);
+    }
+
+    // If too large or not found in quicklist, search in free_list or carve from the top
+    size_t color = block_color(heap, size, block_size);
+    sf_block *bp = find_free_block(heap, block_size + color);
+    // Still not found after expanding the heap; out of memory
+    if (!bp){
+        sf_errno = ENOMEM;
+        SF_PROBE3(malloc_exit, NULL, size, block_size);
+        return NULL;
+    }
+    // The block starts color bytes in; the lead becomes a free block of its own
+    if (color > 0){
+        sf_block *lead = bp;
+        bp = (sf_block *)((char *)lead + color);
+        set_block_meta_data(bp, size, GET_SIZE(&(lead->header)) - color, heap->alloc_flags);
+        set_block_meta_data(lead, 0, color, UNLISTED);
+        release_block(heap, lead);
+    }
+
+    // Check if we can split bp to avoid splinters
+    size_t actual_size = GET_SIZE(&(bp->header));
+    if (actual_size - block_size >= MIN_BLOCK_SIZE){
+        bp = split_block(heap, bp, block_size, size);
+        actual_size = block_size;
+    } else {
+        set_block_meta_data(bp, size, actual_size, heap->alloc_flags);
+    }
+
+    track_payload(heap, size, 0);
+    SF_PROBE3(malloc_exit, (char *)bp + sizeof(sf_header), size, actual_size);
+    return (void *)((char *)bp + sizeof(sf_header));
+}
+
+void heap_free(sf_heap_t *heap, void *pp) {
+    sf_block *bp = (sf_block *)((char *)pp - sizeof(sf_header));
+    ensure_initialized(heap);
+
+    META_CHECK(valid_block(bp));
+    if (!IS_ALLOCATED(&(bp->header)) || IS_IN_QUICK_LIST(&(bp->header))) {
+        abort();
+    }
+
+    if (lifetime_pending > 0 && (heap == &lifetime_heaps[0] || heap == &lifetime_heaps[1])){
+        lifetime_free(pp);
+    }
+
+    // Tracking current payload; remove payload amount from the freed block
+    track_payload(heap, 0, GET_PAYLOAD(&(bp->header)));
+
+    // Get block size
+    size_t block_size = GET_SIZE(&(bp->header));
+    SF_PROBE2(free, pp, block_size);
+
+    // Insert into quicklist for delayed coalesce if small block
+    if (block_size <= sf_conf.quick_limit){
+        set_block_meta_data(bp, 0 , block_size, IN_QUICK_LIST | THIS_BLOCK_ALLOCATED);
+        int q_index = quicklist_index(block_size);
+        insert_quick_list(heap, bp, q_index);
+    } else if (heap == &sf_default_heap && async_free_defer(bp)){
+        // Queued; the drainer thread coalesces it
+        return;
+    } else { // Coalesce and then insert into respective list if large block
+        set_block_meta_data(bp, 0, block_size, UNLISTED);
+        release_block(heap, bp);
+    }
+}
+
+void *heap_realloc(sf_heap_t *heap, void *pp, size_t rsize) {
+
+    if (rsize > MAX_PAYLOAD_SIZE){
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    sf_block *bp = (sf_block *)((char *)pp - sizeof(sf_header));
+    META_CHECK(valid_block(bp) && IS_ALLOCATED(&(bp->header)) && !IS_IN_QUICK_LIST(&(bp->header)));
+    ensure_initialized(heap);
+
+    size_t old_size = GET_SIZE(&(bp->header));
+
+    size_t block_size = calculate_block_size(rsize);
+    size_t old_payload_size = GET_PAYLOAD(&(bp->header));
+
+    if (block_size > old_size){
+        // Larger size requested; adjust malloc bytes to remove overhead
+        void *ptr = heap_malloc(heap, block_size - BLOCK_OVERHEAD);
+
+        if (ptr == NULL){
+            // out of memory
+            return NULL;
+        }
+
+        // -16 gets rid of the header/footer overhead in size
+        memcpy(ptr, pp, old_size - BLOCK_OVERHEAD);
+
+        // Free the old ptr
+        heap_free(heap, pp);
+
+        return ptr;
+    }
+
+    // Smaller size requested; shrinking the block
+    if (old_size - block_size >= MIN_BLOCK_SIZE){
+        // Split the block
+
+        // Set the new header / footer
+        set_block_meta_data(bp, rsize, block_size, heap->alloc_flags);
+
+        // Track current payload; shrink the payload
+        track_payload(heap, rsize, old_payload_size);
+
+        // The left over becomes a new free block
+        sf_block *remain = (sf_block *)((char *)bp + block_size);
+        set_block_meta_data(remain, 0, (old_size-block_size), UNLISTED);
+
+        // Coalesce and insert into appropriate free list
+        release_block(heap, remain);
+
+        return pp;
+
+    } else {
+
+        // Track current payload; shrink the payload
+        track_payload(heap, rsize, old_payload_size);
+
+        // Keep the splinter
+        return pp;
+    }
+}
+
+void *heap_memalign(sf_heap_t *heap, size_t alignment, size_t size) {
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0){
+        sf_errno = EINVAL;
+        return NULL;
+    }
+    // Every payload is already two-row aligned
+    if (alignment <= DSIZE){
+        return heap_malloc(heap, size);
+    }
+
+    ensure_initialized(heap);
+
+    if (size == 0){
+        return NULL;
+    }
+    if (size > MAX_PAYLOAD_SIZE - 2 * MIN_BLOCK_SIZE
+        || alignment > MAX_PAYLOAD_SIZE - 2 * MIN_BLOCK_SIZE - size){
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+
+    // Room for the block, the worst-case misalignment and a free block in front of it
+    size_t block_size = calculate_block_size(size);
+    sf_block *bp = find_free_block(heap, block_size + alignment + MIN_BLOCK_SIZE);
+    if (!bp){
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    size_t total = GET_SIZE(&(bp->header));
+
+    // First aligned payload address that leaves either no gap or a gap that can be a block
+    uintptr_t payload = (uintptr_t)bp + sizeof(sf_header);
+    uintptr_t aligned = (payload + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    while (aligned != payload && aligned - payload < MIN_BLOCK_SIZE){
+        aligned += alignment;
+    }
+    size_t lead = aligned - payload;
+    size_t rest = total - lead;
+    sf_block *ab = (sf_block *)(aligned - sizeof(sf_header));
+
+    // Give back the tail if it can be a block, otherwise keep it as a splinter
+    if (rest - block_size >= MIN_BLOCK_SIZE){
+        set_block_meta_data(ab, size, block_size, heap->alloc_flags);
+        sf_block *remain = (sf_block *)((char *)ab + block_size);
+        set_block_meta_data(remain, 0, rest - block_size, UNLISTED);
+        release_block(heap, remain);
+    } else {
+        set_block_meta_data(ab, size, rest, heap->alloc_flags);
+    }
+
+    // The gap in front becomes a free block of its own
+    if (lead > 0){
+        set_block_meta_data(bp, 0, lead, UNLISTED);
+        release_block(heap, bp);
+    }
+
+    track_payload(heap, size, 0);
+    return (void *)aligned;
+}
+
+/**
+ * Tracks the current payload of a heap and updates its maximum payload in lifetime.
+ */
+
+void track_payload(sf_heap_t *heap, size_t allocated, size_t freed){
+#ifdef SF_FINE_LOCKS
+    // Updated by every thread outside any list lock; the peak is only written when it grows
+    size_t current = __atomic_add_fetch(&heap->current_payload_size, allocated - freed,
+                                        __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&heap->peak_payload_size, __ATOMIC_RELAXED);
+    while (current > peak && !__atomic_compare_exchange_n(&heap->peak_payload_size, &peak, current,
+                                                         1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+    }
+#else
+    heap->current_payload_size -= freed;
+    heap->current_payload_size += allocated;
+    if (heap->current_payload_size > heap->peak_payload_size) {
+        heap->peak_payload_size = heap->current_payload_size;
+    }
+#endif
+}
+
+/**
+ * Readies a heap for a change: sets up the default heap on first use, and marks the file of a
+ * persistent heap dirty before the first change after a flush.
+ */
+
+void ensure_initialized(sf_heap_t *heap){
+    if (heap->persist != NULL){
+        if (!heap->persist->dirty){
+            pheap_mark_dirty(heap);
+        }
+        return;
+    }
+#ifdef SF_FINE_LOCKS
+    if (__atomic_load_n(&heap->initialized, __ATOMIC_ACQUIRE)){
+        return;
+    }
+    lock_acquire(&heap->init_lock);
+#endif
+    if (!heap->initialized){
+        load_config();
+        // Settings made with sf_heap_set_placement before the first allocation stay,
+        // unless SFMM_CONF overrides them
+        if (sf_conf.placement >= 0){
+            heap->placement = sf_conf.placement;
+        }
+        if (sf_conf.fit_candidates > 0){
+            heap->fit_candidates = sf_conf.fit_candidates;
+        }
+        if (sf_conf.colors > 0){
+            heap->colors = sf_conf.colors;
+            heap->color_min = sf_conf.color_min > 0 ? (size_t)sf_conf.color_min : COLOR_MIN;
+        }
+        initialize_lists();
+        initialize_heap();
+        // Other threads check this without the lock
+        __atomic_store_n(&heap->initialized, 1, __ATOMIC_RELEASE);
+    }
+    UNLOCK(&heap->init_lock);
+}
+
+void initialize_heap(){
+#if defined(SF_META_FAST)
+    // Nothing is obfuscated; keep sf_magic() consistent for code that decodes headers
+    sf_set_magic(0x0);
+#elif defined(SF_META_HARDENED)
+    sf_meta_key = MAGIC;
+#endif
+    char *heap_start = (char *)sf_mem_grow();
+    // Reserve 8 byte padding for alignment
+    sf_block *prologue = (sf_block *)(heap_start + 8);
+
+#ifdef SF_SIDE_TABLE
+    // Address space only; pages of the table are committed as the heap reaches them
+    size_t table_size = SIDE_WORDS(SIDE_TABLE_SPAN) * sizeof(uint64_t);
+    void *words = mmap(NULL, table_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (words == MAP_FAILED){
+        abort();
+    }
+    side_table_init(&default_side, (char *)prologue, words, 0);
+#endif
+
+    // Build epilogue
+    create_epilogue();
+
+    // Build prologue
+    set_block_meta_data(prologue, 0, MIN_BLOCK_SIZE, THIS_BLOCK_ALLOCATED);
+
+    // Find size of free block
+    // free block size = page size - padding - prologue - epilogue
+    size_t free_size = PAGE_SZ - WSIZE - MIN_BLOCK_SIZE - WSIZE;
+
+    // Build one giant free block
+    sf_block *free_block = (sf_block *)((char *)prologue + MIN_BLOCK_SIZE);
+    set_block_meta_data(free_block, 0, free_size, UNLISTED);
+
+    // The whole page is the top chunk
+    set_top(&sf_default_heap, free_block);
+}
+
+/**
+ * Grows a heap until it has a free block of the requested size.  Returns 0 on success,
+ * -1 with sf_errno set if the memory is exhausted.
+ */
+
+int expand_heap(sf_heap_t *heap, size_t requested){
+    SF_PROBE2(expand_heap, heap, requested);
+    if (heap->persist != NULL){
+        // Its file has a fixed size
+        sf_errno = ENOMEM;
+        return -1;
+    }
+    if (heap != &sf_default_heap){
+        return add_segment(heap, requested);
+    }
+
+    // Every new page simply extends the top chunk
+    LOCK(&heap->list_locks[sf_conf.free_lists - 1]);
+    while (heap->top == NULL || GET_SIZE(&(heap->top->header)) < requested){
+        sf_block *old_epilogue = (sf_block *)((char *)sf_mem_end() - 8);
+
+        size_t grown = 0;
+        for (int i = 0; i<sf_conf.grow_pages; i++){
+            if (sf_mem_grow() == NULL) {
+                break;
+            }
+            grown += PAGE_SZ;
+        }
+        if (grown == 0) {
+            UNLOCK(&heap->list_locks[sf_conf.free_lists - 1]);
+            sf_errno = ENOMEM;
+            return -1;
+        }
+
+        size_t top_size = heap->top == NULL ? 0 : GET_SIZE(&(heap->top->header));
+        create_epilogue();
+        if (heap->top == NULL){
+            // The block before the old epilogue is allocated, so the pages start a new top
+            set_block_meta_data(old_epilogue, 0, grown, UNLISTED);
+            set_top(heap, old_epilogue);
+        } else {
+            set_block_meta_data(heap->top, 0, top_size + grown, TOP_CHUNK);
+        }
+    }
+    UNLOCK(&heap->list_locks[sf_conf.free_lists - 1]);
+    return 0;
+}
+
+/**
+ * Sets up an empty private heap; segments are added on demand by the first allocation.
+ */
+
+void initialize_private_heap(sf_heap_t *heap){
+    heap->free_list_heads = heap->own_free_list_heads;
+    heap->quick_lists = heap->own_quick_lists;
+    heap->alloc_flags = THIS_BLOCK_ALLOCATED | IN_PRIVATE_HEAP;
+    heap->peak_payload_size = 0;
+    heap->current_payload_size = 0;
+    heap->segments = NULL;
+    heap->top = NULL;
+    heap->persist = NULL;
+    heap->placement = sf_conf.placement >= 0 ? sf_conf.placement : SF_FIRST_FIT;
+    heap->fit_candidates = sf_conf.fit_candidates > 0 ? sf_conf.fit_candidates : BEST_FIT_CANDIDATES;
+    heap->colors = sf_conf.colors;
+    heap->color_min = sf_conf.color_min > 0 ? (size_t)sf_conf.color_min : COLOR_MIN;
+    heap->next_color = 0;
+    initialize_heap_lists(heap);
+    heap->initialized = 1;
+}
+
+/**
+ * Grows a private heap by a segment taken from the default heap that can hold
+ * a free block of at least the requested size.
+ */
+
+int add_segment(sf_heap_t *heap, size_t requested){
+    if (requested > MAX_PAYLOAD_SIZE - SEGMENT_OVERHEAD - PAGE_SZ){
+        sf_errno = ENOMEM;
+        return -1;
+    }
+    // Whole pages of the default heap, including the header and footer of its block
+    size_t size = (requested + SEGMENT_OVERHEAD + 2 * WSIZE + PAGE_SZ - 1) & ~(PAGE_SZ - 1);
+    if (size < SEGMENT_MIN_SIZE){
+        size = SEGMENT_MIN_SIZE;
+    }
+    size -= 2 * WSIZE;
+
+    sf_segment *seg = heap_malloc(&sf_default_heap, size);
+    if (seg == NULL){
+        return -1;
+    }
+#ifdef SF_SIDE_TABLE
+    size_t table_size = SIDE_WORDS(size - SEGMENT_PROLOGUE_OFFSET + DSIZE) * sizeof(uint64_t);
+    uint64_t *words = heap_malloc(&sf_default_heap, table_size);
+    if (words == NULL){
+        heap_free(&sf_default_heap, seg);
+        return -1;
+    }
+    side_table_init(&seg->side, (char *)seg + SEGMENT_PROLOGUE_OFFSET, words, table_size);
+#endif
+    sf_block *seg_block = (sf_block *)((char *)seg - sizeof(sf_header));
+    if (register_segment(seg, (char *)seg_block + GET_SIZE(&(seg_block->header)), heap) != 0){
+#ifdef SF_SIDE_TABLE
+        heap_free(&sf_default_heap, words);
+#endif
+        heap_free(&sf_default_heap, seg);
+        sf_errno = ENOMEM;
+        return -1;
+    }
+    seg->size = size;
+    seg->next = heap->segments;
+    heap->segments = seg;
+
+    // Same layout as the default heap: padding, prologue, one free block, epilogue
+    PUT((char *)seg + size - WSIZE, THIS_BLOCK_ALLOCATED);
+#ifdef SF_SIDE_TABLE
+    side_mark((char *)seg + size - WSIZE, 0, 1);
+#endif
+    sf_block *prologue = (sf_block *)((char *)seg + SEGMENT_PROLOGUE_OFFSET);
+    set_block_meta_data(prologue, 0, MIN_BLOCK_SIZE, THIS_BLOCK_ALLOCATED);
+
+    sf_block *free_block = (sf_block *)((char *)prologue + MIN_BLOCK_SIZE);
+    size_t free_size = size - SEGMENT_OVERHEAD;
+    set_block_meta_data(free_block, 0, free_size, UNLISTED);
+    insert_free_list(heap, free_block, freelist_index(free_size));
+    return 0;
+}
+
+/**
+ * Records the address range of a segment so that heap_of_block can find its owner.
+ */
+
+int register_segment(sf_segment *seg, char *end, sf_heap_t *heap){
+    if (segment_count == segment_capacity){
+        int capacity = segment_capacity ? 2 * segment_capacity : 16;
+        sf_segment_range *map;
+        if (segment_map == NULL){
+            map = heap_malloc(&sf_default_heap, capacity * sizeof(sf_segment_range));
+        } else {
+            map = heap_realloc(&sf_default_heap, segment_map, capacity * sizeof(sf_segment_range));
+        }
+        if (map == NULL){
+            return -1;
+        }
+        segment_map = map;
+        segment_capacity = capacity;
+    }
+
+    // Keep the map sorted by address
+    int i = segment_count;
+    while (i > 0 && segment_map[i - 1].start > (char *)seg){
+        segment_map[i] = segment_map[i - 1];
+        i--;
+    }
+    segment_map[i].start = (char *)seg;
+    segment_map[i].end = end;
+    segment_map[i].heap = heap;
+    segment_count++;
+    return 0;
+}
+
+void unregister_segment(sf_segment *seg){
+    for (int i = 0; i < segment_count; i++){
+        if (segment_map[i].start == (char *)seg){
+            memmove(&segment_map[i], &segment_map[i + 1],
+                    (segment_count - i - 1) * sizeof(sf_segment_range));
+            segment_count--;
+            return;
+        }
+    }
+}
+
+/**
+ * Returns the heap that owns an allocated block.
+ */
+
+sf_heap_t *heap_of_block(sf_block *bp){
+    if (!IS_PRIVATE(&(bp->header))){
+        return &sf_default_heap;
+    }
+    sf_segment_range *range = find_segment(bp);
+    if (range == NULL){
+        // Flag set, but no private heap owns the block
+        abort();
+    }
+    return range->heap;
+}
+
+/**
+ * Binary search for the segment containing an address; NULL if it is not in one.
+ */
+
+sf_segment_range *find_segment(void *p){
+    int lo = 0, hi = segment_count - 1;
+    while (lo <= hi){
+        int mid = (lo + hi) / 2;
+        if ((char *)p < segment_map[mid].start){
+            hi = mid - 1;
+        } else if ((char *)p >= segment_map[mid].end){
+            lo = mid + 1;
+        } else {
+            return &segment_map[mid];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Maps the file of a persistent heap, creating it with the given size and base address
+ * if it does not exist; an existing file is mapped where it was created.  Returns the
+ * mapping, or NULL with sf_errno set.
+ */
+
+sf_pheap_file *pheap_map(const char *path, size_t size, char *base, int *created){
+    int fd = open(path, O_RDWR);
+    *created = 0;
+    if (fd < 0 && errno == ENOENT){
+        if (size < PHEAP_MIN_SIZE || size > PHEAP_MAX_SIZE || size % PAGE_SZ != 0
+            || (uintptr_t)base % PAGE_SZ != 0){
+            sf_errno = EINVAL;
+            return NULL;
+        }
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0){
+            *created = 1;
+            if (ftruncate(fd, size) != 0){
+                sf_errno = errno;
+                close(fd);
+                unlink(path);
+                return NULL;
+            }
+        }
+    }
+    if (fd < 0){
+        sf_errno = errno;
+        return NULL;
+    }
+    if (!*created){
+        sf_pheap_file stored;
+        struct stat st;
+        if (pread(fd, &stored, sizeof(stored), 0) != sizeof(stored) || fstat(fd, &st) != 0
+            || stored.magic != PHEAP_MAGIC || stored.layout != sizeof(sf_pheap_file)
+            || stored.size != (size_t)st.st_size){
+            close(fd);
+            sf_errno = EINVAL;
+            return NULL;
+        }
+        base = stored.base;
+        size = stored.size;
+    }
+
+    void *map = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    int err = errno;
+    close(fd);
+    if (map != MAP_FAILED && map != base){
+        // Only a hint to this kernel, and the address was taken
+        munmap(map, size);
+        map = MAP_FAILED;
+        err = EEXIST;
+    }
+    if (map == MAP_FAILED){
+        if (*created){
+            unlink(path);
+        }
+        sf_errno = err;
+        return NULL;
+    }
+    if (*created){
+        ((sf_pheap_file *)map)->size = size;
+    }
+    return (sf_pheap_file *)map;
+}
+
+/**
+ * Rebuilds the lists of a persistent heap from its blocks, which are re-encoded with the
+ * current header key.  Only allocated blocks of the heap survive; quick-list blocks and
+ * blocks caught between lists by a crash are merged with their free neighbors.  Returns
+ * -1 if a block is damaged.
+ */
+
+int pheap_rebuild(sf_pheap_file *file){
+    sf_heap_t *heap = &(file->heap);
+    sf_header key = file->key;
+    sf_block *prologue = (sf_block *)((char *)PHEAP_SEGMENT(file) + SEGMENT_PROLOGUE_OFFSET);
+    char *end = file->base + file->size - WSIZE;
+    char *run = NULL;
+    size_t run_size = 0;
+    size_t payload = 0;
+
+    initialize_heap_lists(heap);
+    for (char *p = (char *)prologue + MIN_BLOCK_SIZE; p <= end; ){
+        sf_header header = 0;
+        size_t size = 0;
+        if (p < end){
+            header = *(sf_header *)p ^ key;
+            size = (header & 0xFFFFFFFF) & ~(sf_header)0xF;
+            if (size < MIN_BLOCK_SIZE || size > (size_t)(end - p)
+                || *(sf_header *)(p + size - WSIZE) != *(sf_header *)p){
+                return -1;
+            }
+        }
+        int allocated = (header & THIS_BLOCK_ALLOCATED) && (header & IN_PRIVATE_HEAP);
+        if ((p == end || allocated) && run != NULL){
+            set_block_meta_data((sf_block *)run, 0, run_size, UNLISTED);
+            insert_free_list(heap, (sf_block *)run, freelist_index(run_size));
+            run = NULL;
+        }
+        if (p == end){
+            break;
+        }
+        if (allocated){
+            set_block_meta_data((sf_block *)p, header >> 32, size, heap->alloc_flags);
+            payload += header >> 32;
+        } else {
+            if (run == NULL){
+                run = p;
+                run_size = 0;
+            }
+            run_size += size;
+        }
+        p += size;
+    }
+    set_block_meta_data(prologue, 0, MIN_BLOCK_SIZE, THIS_BLOCK_ALLOCATED);
+    PUT(end, THIS_BLOCK_ALLOCATED);
+    heap->current_payload_size = payload;
+    if (payload > heap->peak_payload_size){
+        heap->peak_payload_size = payload;
+    }
+    return 0;
+}
+
+/**
+ * Marks the file of a persistent heap dirty, on disk, before it changes.
+ */
+
+void pheap_mark_dirty(sf_heap_t *heap){
+    heap->persist->dirty = 1;
+    msync(heap->persist->base, PAGE_SZ, MS_SYNC);
+}
+
+int pheap_same_classes(sf_pheap_file *file){
+    return file->free_lists == sf_conf.free_lists && file->quick_limit == sf_conf.quick_limit
+           && memcmp(file->class_bounds, sf_conf.class_bounds, sizeof(file->class_bounds)) == 0;
+}
+
+void pheap_save_classes(sf_pheap_file *file){
+    file->free_lists = sf_conf.free_lists;
+    file->quick_limit = sf_conf.quick_limit;
+    memcpy(file->class_bounds, sf_conf.class_bounds, sizeof(file->class_bounds));
+}
+
+void initialize_lists(){
+    initialize_heap_lists(&sf_default_heap);
+}
+
+void initialize_heap_lists(sf_heap_t *heap){
+    for (int i = 0; i<NUM_QUICK_LISTS; i++){
+        heap->quick_lists[i].length = 0;
+        heap->quick_lists[i].first = NULL;
+    }
+    for (int j = 0; j<NUM_FREE_LISTS; j++){
+        heap->free_list_heads[j].body.links.next = &(heap->free_list_heads[j]);
+        heap->free_list_heads[j].body.links.prev = &(heap->free_list_heads[j]);
+    }
+#ifdef SF_FINE_LOCKS
+    // Not init_lock, which the default heap holds while it gets here
+    memset(heap->quick_locks, 0, sizeof(heap->quick_locks));
+    memset(heap->list_locks, 0, sizeof(heap->list_locks));
+#endif
+}
+
+/**
+ * Applies SFMM_CONF, a comma-separated list of key=value settings such as
+ * "quick_max=16,grow_pages=64", and derives the lookup tables from the result.
+ * Unknown keys and out-of-range values are ignored.
+ */
+
+void load_config(){
+    if (sf_conf.loaded){
+        return;
+    }
+    sf_conf.loaded = 1;
+
+    const char *conf = getenv("SFMM_CONF");
+    if (conf != NULL){
+        parse_config(conf);
+    }
+
+    sf_conf.quick_limit = 16 + (sf_conf.quick_lists * 16);
+    sf_conf.quick_flush = sf_conf.quick_max > 0 ? sf_conf.quick_max : INT_MAX;
+
+    // The generated tables already describe the default classes
+    if (sf_conf.class_min == SF_CLASS_MIN && sf_conf.class_growth == SF_CLASS_GROWTH &&
+        sf_conf.class_steps == SF_CLASS_STEPS && sf_conf.free_lists == NUM_FREE_LISTS){
+        return;
+    }
+    build_class_bounds();
+    int index = 0;
+    for (size_t i = 0; i<=CLASS_TABLE_LIMIT / DSIZE; i++){
+        while (i * DSIZE > sf_conf.class_bounds[index]){
+            index++;
+        }
+        class_table[i] = index;
+    }
+}
+
+/**
+ * Rebuilds the class bounds from the class settings in SFMM_CONF, the same way
+ * tools/sfclasses_gen.c builds the defaults from the spec.  Class i holds sizes in
+ * (class_bounds[i-1], class_bounds[i]]; the last one takes the rest.
+ */
+
+void build_class_bounds(){
+    size_t base = sf_conf.class_min;
+    int count = 0;
+    while (count < sf_conf.free_lists - 1){
+        for (int step = 0; step < sf_conf.class_steps && count < sf_conf.free_lists - 1; step++){
+            size_t bound = base + base * (sf_conf.class_growth - 1) * step / sf_conf.class_steps;
+            bound = (bound + DSIZE - 1) & ~(size_t)(DSIZE - 1);
+            if (count == 0 || bound > sf_conf.class_bounds[count - 1]){
+                sf_conf.class_bounds[count++] = bound;
+            }
+        }
+        base *= sf_conf.class_growth;
+    }
+    for (int i = count; i<NUM_FREE_LISTS; i++){
+        sf_conf.class_bounds[i] = (size_t)-1;
+    }
+}
+
+int parse_config(const char *conf){
+    static const struct {
+        const char *key;
+        int *value;
+        long min, max;
+    } keys[] = {
+        { "quick_lists", &sf_conf.quick_lists, 1, NUM_QUICK_LISTS },
+        { "quick_max", &sf_conf.quick_max, 0, INT_MAX },
+        { "free_lists", &sf_conf.free_lists, 1, NUM_FREE_LISTS },
+        { "class_min", &sf_conf.class_min, MIN_BLOCK_SIZE, CLASS_TABLE_LIMIT },
+        { "class_growth", &sf_conf.class_growth, 2, 16 },
+        { "class_steps", &sf_conf.class_steps, 1, 8 },
+        { "grow_pages", &sf_conf.grow_pages, 1, 65536 },
+        { "fit_candidates", &sf_conf.fit_candidates, 1, INT_MAX },
+        { "colors", &sf_conf.colors, 1, MAX_COLORS },
+        { "color_min", &sf_conf.color_min, 1, INT_MAX },
+    };
+    static const char *placements[] = { "first", "best", "address" };
+    int applied = 0;
+
+    while (*conf != '\0'){
+        const char *end = strchr(conf, ',');
+        size_t len = end ? (size_t)(end - conf) : strlen(conf);
+        const char *eq = memchr(conf, '=', len);
+        if (eq != NULL){
+            size_t key_len = eq - conf;
+            const char *val = eq + 1;
+            size_t val_len = len - key_len - 1;
+            for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); k++){
+                if (strlen(keys[k].key) == key_len && strncmp(conf, keys[k].key, key_len) == 0){
+                    char *stop;
+                    long v = strtol(val, &stop, 10);
+                    if (stop == val + val_len && val_len > 0 && v >= keys[k].min && v <= keys[k].max){
+                        *keys[k].value = (int)v;
+                        applied++;
+                    }
+                }
+            }
+            if (key_len == 9 && strncmp(conf, "placement", 9) == 0){
+                for (int p = 0; p < 3; p++){
+                    if (strlen(placements[p]) == val_len && strncmp(val, placements[p], val_len) == 0){
+                        sf_conf.placement = p;
+                        applied++;
+                    }
+                }
+            }
+        }
+        conf += len;
+        if (*conf == ','){
+            conf++;
+        }
+    }
+    // Class bounds must stay on the 16-byte grid of block sizes
+    sf_conf.class_min &= ~(DSIZE - 1);
+    return applied;
+}
+
+/**
+ * Sets up the header and footer for a block at pointer bp
+ * with the given size and flags
+ */
+
+void set_block_meta_data(sf_block *bp, size_t payload, size_t size, size_t flags) {
+    // Create value that goes into header / footer
+    size_t value = (payload << 32) | size | flags;
+
+#ifdef SF_SIDE_TABLE
+    side_mark(bp, size, (flags & THIS_BLOCK_ALLOCATED) != 0);
+#endif
+
+    // Write the header
+    PUT(&(bp->header), value);
+
+#ifndef SF_SIDE_TABLE
+    // Compute footer address
+    char *footer_addr = (char *)bp + size - WSIZE;
+
+    // Write the footer
+    PUT(footer_addr, value);
+#endif
 }
 
 void set_block_flags(sf_block *bp, int alloc, int quicklist){
+#ifdef SF_SIDE_TABLE
+    uint64_t size = side_block_size(&(bp->header));
+#else
     // Read old header
     size_t old = GET(&(bp->header));
     // Extract the size
     uint64_t size = ((uint64_t)(old & 0x00000000FFFFFFFF) & ~0xF);
+#endif
+
+    size_t flags = 0;
+
+    if (alloc){
+        flags |= THIS_BLOCK_ALLOCATED;
+    }
+    if (quicklist){
+        flags |= IN_QUICK_LIST;
+    }
+
+    size_t new = size | flags;
+
+    // Write the new header
+    PUT(&(bp->header), new);
+#ifdef SF_SIDE_TABLE
+    side_set_alloc(bp, alloc);
+#else
+    // And the new footer
+    PUT((char *)bp + size - WSIZE, new);
+#endif
+}
+
+/**
+ * Create an epilogue at the end of the current heap.
+ */
+
+void create_epilogue() {
+    // Computer epilogue address
+    char *epilogue_ptr = (char *)sf_mem_end() - 8;
+    // Mark it allocated
+    PUT(epilogue_ptr, THIS_BLOCK_ALLOCATED);
+#ifdef SF_SIDE_TABLE
+    side_mark(epilogue_ptr, 0, 1);
+#endif
+}
+
+/*
+ * Only the ends of the default heap need checking here: segments and persistent heaps,
+ * which may lie below or above it, end in an allocated prologue and epilogue of their own.
+ */
+sf_block *get_prev_block(sf_block *bp) {
+    if ((char *)bp == (char *)sf_mem_start() + 40) {
+        return NULL;
+    }
+    // Get previous block footer
+    char *footer_ptr = (char *)bp - WSIZE;
+    // Get previous block size
+    size_t prev_size = HEADER_SIZE(footer_ptr);
+
+    return (sf_block *)((char *)bp - prev_size);
+}
+
+sf_block *get_next_block(sf_block *bp) {
+    if ((char *)bp == (char *)sf_mem_end() - 8) {
+        return NULL;
+    }
+    // Get current block size
+    size_t b_size = GET_SIZE(&(bp->header));
+    // Add block size to get next block
+    return (sf_block *)((char *)bp + b_size);
+}
+
+/*
+ * Segments of private heaps have their own prologue and epilogue, which are allocated,
+ * so coalescing never crosses a segment boundary.  The heap is only needed for its locks.
+ */
+sf_block *coalesce(sf_heap_t *heap, sf_block *bp){
+    size_t new_size = GET_SIZE(&(bp->header));
+    size_t old_size = new_size;
+
+    sf_block *prev = claim_neighbor(heap, bp, 0);
+    if (prev != NULL){
+        size_t prev_size = GET_SIZE(&(prev->header));
+        new_size += prev_size;
+        bp = prev;
+        set_block_meta_data(prev, 0, new_size, UNLISTED);
+    }
+
+    sf_block *next = claim_neighbor(heap, bp, 1);
+    if (next != NULL){
+        size_t next_size = GET_SIZE(&(next->header));
+        new_size += next_size;
+        set_block_meta_data(bp, 0, new_size, UNLISTED);
+    }
+
+    SF_PROBE3(coalesce, bp, old_size, new_size);
+    return bp;
+}
+
+/**
+ * Takes the block right before bp (or after it, if after is set) out of its free list
+ * if it is free, and returns it; NULL if it is not free.
+ */
+
+sf_block *claim_neighbor(sf_heap_t *heap, sf_block *bp, int after){
+    sf_block *neighbor = after ? free_next_block(bp) : free_prev_block(bp);
+#ifdef SF_FINE_LOCKS
+    while (neighbor != NULL){
+        int index = free_list_of(neighbor);
+        lock_acquire(&heap->list_locks[index]);
+        // The neighbor may have been taken, merged or moved since its header was read
+        sf_block *again = after ? free_next_block(bp) : free_prev_block(bp);
+        if (again == neighbor && free_list_of(neighbor) == index){
+            remove_from_free_list(neighbor);
+            if (neighbor == heap->top){
+                heap->top = NULL;
+            }
+            MARK_UNLISTED(neighbor);
+            lock_release(&heap->list_locks[index]);
+            return neighbor;
+        }
+        lock_release(&heap->list_locks[index]);
+        neighbor = again;
+    }
+#else
+    if (neighbor != NULL){
+        remove_from_free_list(neighbor);
+        if (neighbor == heap->top){
+            heap->top = NULL;
+        }
+    }
+#endif
+    return neighbor;
+}
+
+/**
+ * Returns the block right before / after bp if it is free, otherwise NULL.
+ */
+
+sf_block *free_prev_block(sf_block *bp){
+#ifdef SF_SIDE_TABLE
+    sf_side_table *side = side_table_of(bp);
+    size_t g = side_prev_start(side, SIDE_GRANULE(side, bp));
+    return (SIDE_ALLOC(side, g) & SIDE_BIT(g)) ? NULL : (sf_block *)(side->base + g * DSIZE);
+#else
+    sf_block *prev = get_prev_block(bp);
+    if (prev != NULL && !IS_ALLOCATED(&(prev->header))){
+        return prev;
+    }
+    return NULL;
+#endif
+}
+
+sf_block *free_next_block(sf_block *bp){
+#ifdef SF_SIDE_TABLE
+    sf_side_table *side = side_table_of(bp);
+    size_t g = SIDE_GRANULE(side, bp) + GET_SIZE(&(bp->header)) / DSIZE;
+    return (SIDE_ALLOC(side, g) & SIDE_BIT(g)) ? NULL : (sf_block *)(side->base + g * DSIZE);
+#else
+    sf_block *next = get_next_block(bp);
+    if (next != NULL && !IS_ALLOCATED(&(next->header))){
+        return next;
+    }
+    return NULL;
+#endif
+}
+
+sf_block *split_block(sf_heap_t *heap, sf_block *bp, size_t split_size, size_t payload_size){
+    size_t remain_size = GET_SIZE(&(bp->header)) - split_size;
+    SF_PROBE3(split, bp, split_size, remain_size);
+    set_block_meta_data(bp, payload_size, split_size, heap->alloc_flags);
+    sf_block *remain = (sf_block *)((char *)bp + split_size);
+    set_block_meta_data(remain, 0, remain_size, UNLISTED);
+
+    int remain_index = freelist_index(remain_size);
+    insert_free_list(heap, remain, remain_index);
+
+    return bp;
+}
+
+/**
+ * Finds a free block of at least the requested size and takes it out of the free lists.
+ */
+
+sf_block *search_free_list_for_block(sf_heap_t *heap, size_t requested){
+    if (heap->placement == SF_BEST_FIT){
+        return search_best_fit(heap, requested);
+    }
+    // First fit; under SF_ADDRESS_FIT the lists are sorted, so it finds the lowest address
+    int start = freelist_index(requested);
+    // Search from first size-eligible free_list, move to next if block not found
+    for (int i = start; i<sf_conf.free_lists; i++){
+        sf_block *head = &(heap->free_list_heads[i]);
+        if (LIST_EMPTY(head)){
+            continue;
+        }
+        LOCK(&heap->list_locks[i]);
+        sf_block *current = head->body.links.next;
+
+        // Traverse until reached back to head
+        while (current != head){
+            if (GET_SIZE(&(current->header)) >= requested) {
+                // Block with sufficient size found
+                current = take_free_block(heap, current, requested);
+                UNLOCK(&heap->list_locks[i]);
+                return current;
+            }
+            current = current->body.links.next;
+        }
+        UNLOCK(&heap->list_locks[i]);
+    }
+    // No block in the free lists could satisfy the size
+    return NULL;
+}
+
+/**
+ * Bounded best fit: picks the smallest of the first few fitting blocks.  Blocks of a later
+ * size class are all larger, so only the first class with a fitting block is examined.
+ * The top chunk is only used when no other block fits.
+ */
+
+sf_block *search_best_fit(sf_heap_t *heap, size_t requested){
+    int start = freelist_index(requested);
+    for (int i = start; i<sf_conf.free_lists; i++){
+        sf_block *head = &(heap->free_list_heads[i]);
+        if (LIST_EMPTY(head)){
+            continue;
+        }
+        LOCK(&heap->list_locks[i]);
+        sf_block *current = head->body.links.next;
+        sf_block *best = NULL;
+        size_t best_size = 0;
+        int seen = 0;
+
+        // The top chunk is always the last block of the last list
+        while (current != head && current != heap->top){
+            size_t size = GET_SIZE(&(current->header));
+            if (size >= requested){
+                if (best == NULL || size < best_size){
+                    best = current;
+                    best_size = size;
+                }
+                // An exact fit cannot be beaten
+                if (size == requested || ++seen == heap->fit_candidates){
+                    break;
+                }
+            }
+            current = current->body.links.next;
+        }
+        if (best != NULL){
+            best = take_free_block(heap, best, requested);
+            UNLOCK(&heap->list_locks[i]);
+            return best;
+        }
+        UNLOCK(&heap->list_locks[i]);
+    }
+    sf_block *bp = NULL;
+    LOCK(&heap->list_locks[sf_conf.free_lists - 1]);
+    if (heap->top != NULL && GET_SIZE(&(heap->top->header)) >= requested){
+        bp = carve_top(heap, requested);
+    }
+    UNLOCK(&heap->list_locks[sf_conf.free_lists - 1]);
+    return bp;
+}
+
+sf_block *find_free_block(sf_heap_t *heap, size_t requested){
+    int passes = 1;
+    sf_block *bp = search_free_list_for_block(heap, requested);
+    // Merging the deferred small blocks may be enough to satisfy the request
+    if (!bp && consolidate(heap) > 0){
+        passes = 2;
+        bp = search_free_list_for_block(heap, requested);
+    }
+    // If no available block found, expand heap and try again; with fine-grained locks
+    // another thread may take the new memory first
+    while (!bp){
+        passes = 3;
+        if (expand_heap(heap, requested) != 0){
+            break;
+        }
+        bp = search_free_list_for_block(heap, requested);
+    }
+    SF_PROBE3(free_list_search, requested, bp, passes);
+    return bp;
+}
+
+/**
+ * Hands out a block found in a free list, detached from it: the block itself, or the
+ * front of the top chunk.  Called with the list's lock held.
+ */
+
+sf_block *take_free_block(sf_heap_t *heap, sf_block *bp, size_t requested){
+    if (bp == heap->top){
+        return carve_top(heap, requested);
+    }
+    remove_from_free_list(bp);
+    MARK_UNLISTED(bp);
+    return bp;
+}
+
+/**
+ * Cuts a free block of the given size off the front of the top chunk.  The rest of the
+ * top stays where it is in the last free list, so nothing is reinserted.
+ */
+
+sf_block *carve_top(sf_heap_t *heap, size_t size){
+    sf_block *top = heap->top;
+    size_t top_size = GET_SIZE(&(top->header));
+
+    // Too little would be left for a block; give out the whole top
+    if (top_size - size < MIN_BLOCK_SIZE){
+        remove_from_free_list(top);
+        heap->top = NULL;
+        MARK_UNLISTED(top);
+        return top;
+    }
+
+    sf_block *rest = (sf_block *)((char *)top + size);
+    rest->body.links.next = top->body.links.next;
+    rest->body.links.prev = top->body.links.prev;
+    rest->body.links.next->body.links.prev = rest;
+    rest->body.links.prev->body.links.next = rest;
+    set_block_meta_data(rest, 0, top_size - size, TOP_CHUNK);
+    heap->top = rest;
+
+    set_block_meta_data(top, 0, size, UNLISTED);
+    return top;
+}
+
+/**
+ * Bytes a block for a request of size bytes is to be offset by: the next of the heap's
+ * colors times COLOR_LINE if coloring is on and the request is large enough, otherwise 0.
+ */
+
+size_t block_color(sf_heap_t *heap, size_t size, size_t block_size){
+    if (heap->colors <= 1 || size < heap->color_min){
+        return 0;
+    }
+    size_t color = (__atomic_fetch_add(&heap->next_color, 1, __ATOMIC_RELAXED) % heap->colors) * COLOR_LINE;
+    return block_size + color <= MAX_PAYLOAD_SIZE ? color : 0;
+}
+
+/**
+ * Makes bp the top chunk.  It is linked at the tail of the last free list, so a search
+ * tries every other free block before it.
+ */
+
+void set_top(sf_heap_t *heap, sf_block *bp){
+    sf_block *head = &(heap->free_list_heads[sf_conf.free_lists - 1]);
+    set_block_meta_data(bp, 0, GET_SIZE(&(bp->header)), TOP_CHUNK);
+    bp->body.links.next = head;
+    bp->body.links.prev = head->body.links.prev;
+    head->body.links.prev->body.links.next = bp;
+    head->body.links.prev = bp;
+    heap->top = bp;
+}
+
+/**
+ * Coalesces a block that was just marked free and puts it in the appropriate free list,
+ * or makes it the top chunk if it now ends at the epilogue.
+ */
+
+void release_block(sf_heap_t *heap, sf_block *bp){
+    bp = coalesce(heap, bp);
+    size_t size = GET_SIZE(&(bp->header));
+    if (heap == &sf_default_heap && (char *)bp + size == (char *)sf_mem_end() - 8){
+        LOCK(&heap->list_locks[sf_conf.free_lists - 1]);
+        // Unless the heap grew since it was checked without the lock
+        if ((char *)bp + size == (char *)sf_mem_end() - 8){
+            // Merging with the old top took it off its list
+            set_top(heap, bp);
+            UNLOCK(&heap->list_locks[sf_conf.free_lists - 1]);
+            return;
+        }
+        UNLOCK(&heap->list_locks[sf_conf.free_lists - 1]);
+    }
+    insert_free_list(heap, bp, freelist_index(size));
+}
+
+/**
+ * Coalesces every block deferred in the quick lists and moves it to the free lists.
+ * Blocks next to each other in quick lists end up merged, since each one joins its
+ * neighbors once they are free.  Returns the number of blocks that were moved.
+ */
+
+int consolidate(sf_heap_t *heap){
+    int moved = 0;
+    for (int i = 0; i<NUM_QUICK_LISTS; i++){
+        sf_block *bp;
+        while ((bp = pop_quick_list(heap, i)) != NULL){
+            release_block(heap, bp);
+            moved++;
+        }
+    }
+    if (moved > 0){
+        SF_PROBE2(consolidate, heap, moved);
+    }
+    return moved;
+}
+
+void insert_free_list(sf_heap_t *heap, sf_block *bp, int index){
+    sf_block *head = &(heap->free_list_heads[index]);
+    LOCK(&heap->list_locks[index]);
+    set_block_flags(bp, 0 /*alloc*/, 0 /*quicklist*/);
+    // LIFO principle, or ascending addresses for SF_ADDRESS_FIT
+    sf_block *next = head->body.links.next;
+    if (heap->placement == SF_ADDRESS_FIT){
+        while (next != head && next < bp){
+            next = next->body.links.next;
+        }
+    }
+    bp->body.links.next = next;
+    bp->body.links.prev = next->body.links.prev;
+    next->body.links.prev->body.links.next = bp;
+    next->body.links.prev = bp;
+    UNLOCK(&heap->list_locks[index]);
+}
+
+void remove_from_free_list(sf_block *bp){
+    // Refuse to unlink a block whose neighbors do not point back at it
+    META_CHECK(bp->body.links.next->body.links.prev == bp
+               && bp->body.links.prev->body.links.next == bp);
+    // Update the links of the previous / next block in free list
+    bp->body.links.next->body.links.prev = bp->body.links.prev;
+    bp->body.links.prev->body.links.next = bp->body.links.next;
+
+    // Remove links to previous / next block in free list
+    bp->body.links.next = NULL;
+    bp->body.links.prev = NULL;
+}
+
+void insert_quick_list(sf_heap_t *heap, sf_block *bp, int index){
+    sf_quick_list *list = &(heap->quick_lists[index]);
+    sf_block *flushed = NULL;
+    LOCK(&heap->quick_locks[index]);
+    // Unless SFMM_CONF sets quick_max, the block stays uncoalesced until consolidate() runs
+    if (list->length == sf_conf.quick_flush){
+        SF_PROBE2(quick_flush, index, sf_conf.quick_flush);
+        // The whole list goes; it is released once the quick list is unlocked
+        flushed = list->first;
+        list->first = NULL;
+        list->length = 0;
+    }
+    // Update flags
+    set_block_flags(bp, 1 /*alloc*/, 1 /*quicklist*/);
+    // LIFO principle
+    bp->body.links.next = list->first;
+    list->first = bp;
+    list->length += 1;
+    UNLOCK(&heap->quick_locks[index]);
+
+    while (flushed != NULL){
+        sf_block *ptr = flushed;
+        META_CHECK(IS_IN_QUICK_LIST(&(ptr->header)) && quicklist_index(GET_SIZE(&(ptr->header))) == index);
+        flushed = ptr->body.links.next;
+        leave_quick_list(ptr);
+        release_block(heap, ptr);
+    }
+}
+
+sf_block *pop_quick_list(sf_heap_t *heap, int index) {
+    sf_quick_list *list = &(heap->quick_lists[index]);
+    if (__atomic_load_n(&list->first, __ATOMIC_RELAXED) == NULL){
+        return NULL;
+    }
+    LOCK(&heap->quick_locks[index]);
+    if (list->length == 0){
+        UNLOCK(&heap->quick_locks[index]);
+        return NULL;
+    }
+
+    // Pop the first block
+    sf_block *bp = list->first;
+    META_CHECK(IS_IN_QUICK_LIST(&(bp->header)) && quicklist_index(GET_SIZE(&(bp->header))) == index);
+    list->first = bp->body.links.next;
+    list->length--;
+    UNLOCK(&heap->quick_locks[index]);
+
+    leave_quick_list(bp);
+    return bp;
+}
+
+/**
+ * Clears the quick-list state of a block taken off a quick list.  It is left free, or
+ * marked allocated while it is unlisted under fine-grained locking.
+ */
+
+void leave_quick_list(sf_block *bp){
+    bp->body.links.next = NULL;
+    set_block_meta_data(bp, 0, GET_SIZE(&(bp->header)), UNLISTED);
+}
+
+int freelist_index(size_t requested){
+    if (requested <= CLASS_TABLE_LIMIT){
+        return class_table[(requested + DSIZE - 1) / DSIZE];
+    }
+    int index = 0;
+    while (index < sf_conf.free_lists - 1 && requested > sf_conf.class_bounds[index]){
+        index += 1;
+    }
+    return index;
+}
+
+int quicklist_index(int size){
+    return (size >> 4) - (MIN_BLOCK_SIZE >> 4);
+}
+
+size_t calculate_block_size(size_t size){
+    // Header / footer overhead, rounded up to a multiple of 16
+    size_t block_size = (size + BLOCK_OVERHEAD + 15) & ~(size_t)15;
+    return block_size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : block_size;
+}
+
+int valid_pointer(sf_block *p){
+    // ptr is NULL
+    if (p == NULL) return 0;
+    // ptr is not 16 byte aligned
+    //if ((uintptr_t)p % 16) return 0;
+
+    // ptr is before prologue
+    //if ((char *)p < (char *)sf_mem_start() + 40) return 0;
+    // ptr is after epilogue
+    //if ((char *)p > (char *)sf_mem_end() - 8) return 0;
+
+    size_t size = GET_SIZE(&(p->header));
+
+    // Must be at least MIN_BLOCK_SIZE
+    if (size < MIN_BLOCK_SIZE) return 0;
+
+    // Must be 16 byte aligned
+    if (size % 16 != 0) return 0;
+
+    return 1;
+}
+
+/**
+ * Structural check of a block that is about to be released or resized:
+ * it must lie inside the heap, have a sane size and a footer matching its header
+ * (with the side table, a header matching the table).
+ */
+
+int valid_block(sf_block *bp){
+    char *start = (char *)sf_mem_start() + 40;
+    char *end = (char *)sf_mem_end() - 8;
+
+    // Payload must be two-row aligned and the header inside the heap
+    if (((uintptr_t)bp + sizeof(sf_header)) % DSIZE != 0) return 0;
+    if ((char *)bp < start || (char *)bp >= end){
+        // or inside the file mapping of a persistent heap
+        sf_segment_range *range = find_segment(bp);
+        if (range == NULL || range->heap->persist == NULL) return 0;
+        start = range->start;
+        end = range->end - WSIZE;
+    }
+
+    size_t size = GET_SIZE(&(bp->header));
+    if (size < MIN_BLOCK_SIZE || size > (size_t)(end - (char *)bp)) return 0;
+
+#ifdef SF_SIDE_TABLE
+    // The size came from the side table; the header must agree with it on the block
+    sf_side_table *side = side_table_of(bp);
+    size_t g = SIDE_GRANULE(side, bp);
+    return (SIDE_STARTS(side, g) & SIDE_BIT(g)) && HEADER_SIZE(&(bp->header)) == size
+           && IS_ALLOCATED(&(bp->header)) == ((SIDE_ALLOC(side, g) & SIDE_BIT(g)) != 0);
+#else
+    // Header and footer are obfuscated with the same key, so compare them as stored
+    return *(sf_header *)&(bp->header) == *(sf_header *)((char *)bp + size - WSIZE);
+#endif
+}
+
+/*
+    Handle helpers
+*/
+
+/**
+ * Doubles the handle table.  It is mapped outside the heap, so that it never sits
+ * between the objects and the top chunk; handles are indices, so it may move.  Returns
+ * -1 with sf_errno set if it cannot grow.
+ */
+
+int handle_grow(){
+    size_t capacity = handle_capacity ? 2 * handle_capacity : HANDLE_TABLE_MIN;
+    sf_handle_entry *table = mmap(NULL, capacity * sizeof(sf_handle_entry), PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED){
+        sf_errno = ENOMEM;
+        return -1;
+    }
+    if (handle_table != NULL){
+        memcpy(table, handle_table, handle_capacity * sizeof(sf_handle_entry));
+        munmap(handle_table, handle_capacity * sizeof(sf_handle_entry));
+    }
+    // Entry 0 stays zeroed, so it never looks live
+    for (size_t i = capacity - 1; i >= handle_capacity && i > 0; i--){
+        table[i].next_free = handle_free;
+        handle_free = i;
+    }
+    handle_table = table;
+    handle_capacity = capacity;
+    return 0;
+}
+
+/**
+ * The entry of a live handle; aborts on anything else.
+ */
+
+sf_handle_entry *handle_entry(sf_handle_t h){
+    if (h == 0 || h >= handle_capacity || handle_table[h].object == NULL){
+        abort();
+    }
+    return &handle_table[h];
+}
+
+/**
+ * Moves the object of an unpinned handle to the lowest free block below it that can hold
+ * its block, and frees the old block, which merges with whatever is free around it.
+ * Returns the number of bytes moved, 0 if there is no such free block.
+ */
+
+size_t handle_move(sf_heap_t *heap, sf_handle_entry *entry){
+    sf_block *bp = (sf_block *)((char *)entry->object - HANDLE_PREFIX - sizeof(sf_header));
+    META_CHECK(valid_block(bp) && *(sf_handle_t *)bp->body.payload == (sf_handle_t)(entry - handle_table));
+    size_t size = GET_SIZE(&(bp->header));
+    sf_block *hole = lowest_fit(heap, size, bp);
+    if (hole == NULL){
+        return 0;
+    }
+    take_free_block(heap, hole, size);
+    size_t payload = GET_PAYLOAD(&(bp->header));
+    if (GET_SIZE(&(hole->header)) - size >= MIN_BLOCK_SIZE){
+        split_block(heap, hole, size, payload);
+    } else {
+        set_block_meta_data(hole, payload, GET_SIZE(&(hole->header)), heap->alloc_flags);
+    }
+    memcpy(hole->body.payload, bp->body.payload, size - BLOCK_OVERHEAD);
+    entry->object = hole->body.payload + HANDLE_PREFIX;
+
+    set_block_meta_data(bp, 0, size, UNLISTED);
+    release_block(heap, bp);
+    return size;
+}
+
+/**
+ * The free block with the lowest address below limit that has room for size bytes, or
+ * NULL.  Lists kept in address order are sorted, so their first fit is their lowest.
+ */
+
+sf_block *lowest_fit(sf_heap_t *heap, size_t size, sf_block *limit){
+    sf_block *lowest = NULL;
+    for (int i = freelist_index(size); i < sf_conf.free_lists; i++){
+        sf_block *head = &(heap->free_list_heads[i]);
+        for (sf_block *bp = head->body.links.next; bp != head; bp = bp->body.links.next){
+            if (bp >= limit || bp == heap->top || GET_SIZE(&(bp->header)) < size){
+                continue;
+            }
+            if (lowest == NULL || bp < lowest){
+                lowest = bp;
+            }
+            if (heap->placement == SF_ADDRESS_FIT){
+                break;
+            }
+        }
+    }
+    return lowest;
+}
+
+/*
+    Lifetime helpers
+*/
+
+sf_heap_t *lifetime_heap(int hint){
+    pthread_once(&lifetime_once, lifetime_init);
+    return &lifetime_heaps[hint == SF_SHORT_LIVED ? 0 : 1];
+}
+
+void lifetime_init(){
+    // The heaps copy their settings from SFMM_CONF, which sf_malloc_hint may be the first to need
+    ensure_initialized(&sf_default_heap);
+    initialize_private_heap(&lifetime_heaps[0]);
+    initialize_private_heap(&lifetime_heaps[1]);
+}
+
+/**
+ * The statistics of a call site, created on its first allocation.  NULL if the table is
+ * full, in which case the site's objects are treated as long-lived.
+ */
 
-    size_t flags = 0;
+sf_lifetime_site *lifetime_site(void *caller){
+    size_t i = ((uintptr_t)caller * 0x9E3779B97F4A7C15ULL) >> 56;
+    for (int n = 0; n < LIFETIME_SITES; n++, i = (i + 1) % LIFETIME_SITES){
+        sf_lifetime_site *site = &lifetime_sites[i];
+        if (site->caller == caller){
+            return site;
+        }
+        if (site->caller == NULL){
+            site->caller = caller;
+            return site;
+        }
+    }
+    return NULL;
+}
 
-    if (alloc){
-        flags |= THIS_BLOCK_ALLOCATED;
+/**
+ * Whether a site's objects go to the short-lived heap: only once a few samples died young
+ * and outnumber those that lived long three to one.
+ */
+
+int lifetime_is_short(sf_lifetime_site *site){
+    return site->short_lived >= 4 && site->short_lived > 3 * site->long_lived;
+}
+
+/**
+ * Records the birth of a sampled object.  A slot held by an older sample that has already
+ * outlived LIFETIME_SHORT is taken over; a younger one keeps it and this object goes unsampled.
+ */
+
+void lifetime_sample(void *pp, sf_lifetime_site *site){
+    sf_lifetime_sample *sample = &lifetime_samples[((uintptr_t)pp >> 4) % LIFETIME_SAMPLES];
+    if (sample->ptr != NULL){
+        if (lifetime_clock - sample->birth < LIFETIME_SHORT){
+            return;
+        }
+        sample->site->long_lived++;
+        lifetime_resolve(sample);
     }
-    if (quicklist){
-        flags |= IN_QUICK_LIST;
+    sample->ptr = pp;
+    sample->site = site;
+    sample->birth = lifetime_clock;
+    lifetime_pending++;
+}
+
+/**
+ * Clears a sample whose lifetime was counted, and ages its site's counts.
+ */
+
+void lifetime_resolve(sf_lifetime_sample *sample){
+    sf_lifetime_site *site = sample->site;
+    lifetime_pending--;
+    sample->ptr = NULL;
+    if (site->short_lived + site->long_lived >= LIFETIME_DECAY){
+        site->short_lived /= 2;
+        site->long_lived /= 2;
     }
+}
 
-    size_t new = size | flags;
+/**
+ * Counts the lifetime of a block of a lifetime heap that is being freed, if it was sampled.
+ */
 
-    // Write the new header
-    PUT(&(bp->header), new);
-    // And the new footer
-    PUT((char *)bp + size - WSIZE, new);
+void lifetime_free(void *pp){
+    sf_lifetime_sample *sample = &lifetime_samples[((uintptr_t)pp >> 4) % LIFETIME_SAMPLES];
+    if (sample->ptr != pp){
+        return;
+    }
+    if (lifetime_clock - sample->birth < LIFETIME_SHORT){
+        sample->site->short_lived++;
+    } else {
+        sample->site->long_lived++;
+    }
+    lifetime_resolve(sample);
 }
 
+/*
+    Locality helpers
+*/
+
 /**
- * Create an epilogue at the end of the current heap.
+ * Whether bp starts in the page of hint or in one next to it.
  */
 
-void create_epilogue() {
-    // Computer epilogue address
-    char *epilogue_ptr = (char *)sf_mem_end() - 8;
-    // Mark it allocated
-    PUT(epilogue_ptr, THIS_BLOCK_ALLOCATED); 
+int near_page(sf_block *bp, sf_block *hint){
+    uintptr_t page = (uintptr_t)bp / PAGE_SZ, hint_page = (uintptr_t)hint / PAGE_SZ;
+    return page + 1 >= hint_page && page <= hint_page + 1;
 }
 
-sf_block *get_prev_block(sf_block *bp) {
-    if ((char *)bp <= (char *)sf_mem_start() + 40) {
-        return NULL;
-    }
-    // Get previous block footer
-    char *footer_ptr = (char *)bp - WSIZE;
-    // Get previous block size
-    size_t prev_size = GET_SIZE(footer_ptr);
+/**
+ * Takes a block of exactly block_size near hint off the first NEAR_SCAN entries of
+ * its quick list, or returns NULL.  The block is left unlisted.
+ */
 
-    return (sf_block *)((char *)bp - prev_size);
+sf_block *near_quick_block(sf_heap_t *heap, sf_block *hint, size_t block_size){
+    int index = quicklist_index(block_size);
+    sf_quick_list *list = &(heap->quick_lists[index]);
+    LOCK(&heap->quick_locks[index]);
+    sf_block **link = &list->first;
+    for (int n = 0; n < list->length && n < NEAR_SCAN; n++){
+        sf_block *bp = *link;
+        if (near_page(bp, hint)){
+            *link = bp->body.links.next;
+            list->length--;
+            UNLOCK(&heap->quick_locks[index]);
+            leave_quick_list(bp);
+            return bp;
+        }
+        link = &bp->body.links.next;
+    }
+    UNLOCK(&heap->quick_locks[index]);
+    return NULL;
 }
 
-sf_block *get_next_block(sf_block *bp) {
-    if ((char *)bp >= (char *)sf_mem_end() - 8) {
-        return NULL;
+/**
+ * Allocates the part of the free block right after hint, or else right before it, that
+ * touches hint, and frees the rest.  Returns NULL if neither neighbor is free and large enough.
+ */
+
+sf_block *near_neighbor_block(sf_heap_t *heap, sf_block *hint, size_t block_size, size_t size){
+    for (int after = 1; after >= 0; after--){
+        sf_block *peek = after ? free_next_block(hint) : free_prev_block(hint);
+        if (peek == NULL || GET_SIZE(&(peek->header)) < block_size){
+            continue;
+        }
+        sf_block *bp = claim_neighbor(heap, hint, after);
+        if (bp == NULL){
+            continue;
+        }
+        size_t free_size = GET_SIZE(&(bp->header));
+        if (free_size < block_size){
+            // It shrank before it could be claimed
+            release_block(heap, bp);
+            continue;
+        }
+        if (free_size - block_size < MIN_BLOCK_SIZE){
+            set_block_meta_data(bp, size, free_size, heap->alloc_flags);
+            return bp;
+        }
+        sf_block *rest;
+        if (after){
+            set_block_meta_data(bp, size, block_size, heap->alloc_flags);
+            rest = (sf_block *)((char *)bp + block_size);
+        } else {
+            rest = bp;
+            bp = (sf_block *)((char *)bp + free_size - block_size);
+            set_block_meta_data(bp, size, block_size, heap->alloc_flags);
+        }
+        set_block_meta_data(rest, 0, free_size - block_size, UNLISTED);
+        release_block(heap, rest);
+        return bp;
     }
-    // Get current block size
-    size_t b_size = GET_SIZE(&(bp->header));
-    // Add block size to get next block
-    return (sf_block *)((char *)bp + b_size);
+    return NULL;
 }
 
-sf_block *coalesce(sf_block *bp){
-    size_t new_size = GET_SIZE(&(bp->header));
+/**
+ * Takes a free block of at least block_size near hint off the first NEAR_SCAN entries of
+ * the free lists that may hold one, or returns NULL.  The top chunk is left alone.
+ */
 
-    sf_block *prev = get_prev_block(bp);
-    if (prev != NULL && (char *)prev >= (char *)sf_mem_start() + 8 
-        && !IS_ALLOCATED(&(prev->header))){
-        remove_from_free_list(prev);
-        size_t prev_size = GET_SIZE(&(prev->header));
-        new_size += prev_size;
-        bp = prev;
-        set_block_meta_data(prev, 0, new_size, 0);
+sf_block *near_free_block(sf_heap_t *heap, sf_block *hint, size_t block_size){
+    for (int i = freelist_index(block_size); i < sf_conf.free_lists; i++){
+        sf_block *head = &(heap->free_list_heads[i]);
+        if (LIST_EMPTY(head)){
+            continue;
+        }
+        LOCK(&heap->list_locks[i]);
+        sf_block *bp = head->body.links.next;
+        for (int n = 0; bp != head && n < NEAR_SCAN; n++, bp = bp->body.links.next){
+            if (bp != heap->top && GET_SIZE(&(bp->header)) >= block_size && near_page(bp, hint)){
+                bp = take_free_block(heap, bp, block_size);
+                UNLOCK(&heap->list_locks[i]);
+                return bp;
+            }
+        }
+        UNLOCK(&heap->list_locks[i]);
     }
+    return NULL;
+}
 
-    sf_block *next = get_next_block(bp);
-    if (next != NULL && (char *)next < (char *)sf_mem_end() - 8
-        && !IS_ALLOCATED(&(next->header))){
-        remove_from_free_list(next);
-        size_t next_size = GET_SIZE(&(next->header));
-        new_size += next_size;
-        set_block_meta_data(bp, 0, new_size, 0);
+/*
+    Snapshot helpers
+*/
+
+/**
+ * The SF_DUMP_* state of a block of the default heap.
+ */
+
+int dump_state(sf_heap_t *heap, sf_block *bp){
+    if (bp == heap->top){
+        return SF_DUMP_TOP;
+    }
+    if (IS_IN_QUICK_LIST(&(bp->header))){
+        return SF_DUMP_QUICK;
     }
+    return IS_ALLOCATED(&(bp->header)) ? SF_DUMP_ALLOCATED : SF_DUMP_FREE;
+}
 
-    return bp;
+/**
+ * Writes all of buf to fd, retrying short and interrupted writes.  Sets sf_errno and
+ * returns -1 if the write fails.
+ */
+
+int dump_write(int fd, const void *buf, size_t size){
+    const char *p = buf;
+    while (size > 0){
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n <= 0){
+            sf_errno = n < 0 ? errno : EIO;
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
 }
 
-sf_block *split_block(sf_block *bp, size_t split_size, size_t payload_size){
-    size_t remain_size = GET_SIZE(&(bp->header)) - split_size;
-    remove_from_free_list(bp);
-    set_block_meta_data(bp, payload_size, split_size, THIS_BLOCK_ALLOCATED);
-    sf_block *remain = (sf_block *)((char *)bp + split_size);
-    set_block_meta_data(remain, 0, remain_size, 0);
+/**
+ * Frees every segment of a private heap that holds nothing but one free block back to the
+ * default heap.  Returns the number of bytes freed.
+ */
 
-    int remain_index = freelist_index(remain_size);
-    insert_free_list(remain, remain_index);
+size_t release_empty_segments(sf_heap_t *heap){
+    consolidate(heap);
+    size_t released = 0;
+    sf_segment **link = &heap->segments;
+    while (*link != NULL){
+        sf_segment *seg = *link;
+        sf_block *first = (sf_block *)((char *)seg + SEGMENT_PROLOGUE_OFFSET + MIN_BLOCK_SIZE);
+        if (IS_ALLOCATED(&(first->header)) || GET_SIZE(&(first->header)) != seg->size - SEGMENT_OVERHEAD){
+            link = &seg->next;
+            continue;
+        }
+        remove_from_free_list(first);
+        *link = seg->next;
+        released += seg->size;
+        unregister_segment(seg);
+#ifdef SF_SIDE_TABLE
+        heap_free(&sf_default_heap, seg->side.words);
+#endif
+        heap_free(&sf_default_heap, seg);
+    }
+    return released;
+}
 
-    return bp;
+/**
+ * Hands the whole pages between the links and the footer of a free block back to the
+ * system.  They read as zero when the block is used again.  Returns the bytes released.
+ */
+
+size_t discard_free_pages(sf_block *bp){
+    uintptr_t start = ((uintptr_t)&(bp->body.links.prev) + sizeof(sf_block *) + PAGE_SZ - 1)
+                      & ~(uintptr_t)(PAGE_SZ - 1);
+    uintptr_t end = ((uintptr_t)bp + GET_SIZE(&(bp->header)) - WSIZE) & ~(uintptr_t)(PAGE_SZ - 1);
+    if (end <= start || madvise((void *)start, end - start, MADV_DONTNEED) != 0){
+        return 0;
+    }
+    return end - start;
 }
 
+/*
+    Asynchronous free queue
+*/
 
-sf_block *search_free_list_for_block(size_t requested){
-    int start = freelist_index(requested);
-    // Search from first size-eligible free_list, move to next if block not found
-    for (int i = start; i<NUM_FREE_LISTS; i++){
-        sf_block *head = &(sf_free_list_heads[i]);
-        sf_block *current = head->body.links.next;
+/**
+ * Queues a large block that heap_free is releasing on the default heap.  Returns 0 if
+ * asynchronous free is off or the queue is full, in which case the caller frees the block
+ * itself: that is the backpressure, and it cannot deadlock on the caller's lock.
+ */
 
-        // Traverse until reached back to head
-        while (current != head){
-            if (GET_SIZE(&(current->header)) >= requested) {
-                // Block with sufficient size found
-                return current;
+int async_free_defer(sf_block *bp){
+    if (!__atomic_load_n(&async_free.running, __ATOMIC_ACQUIRE)){
+        return 0;
+    }
+    set_block_meta_data(bp, 0, GET_SIZE(&(bp->header)), IN_QUICK_LIST | THIS_BLOCK_ALLOCATED);
+    int queued = async_free_push(bp);
+    async_free_wake(!queued);
+    return queued;
+}
+
+int async_free_push(sf_block *bp){
+    size_t pos = __atomic_load_n(&async_free.tail, __ATOMIC_RELAXED);
+    for (;;){
+        sf_async_slot *slot = &async_free.slots[pos & async_free.mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos){
+            if (__atomic_compare_exchange_n(&async_free.tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+                slot->bp = bp;
+                __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+                if ((pos + 1) % ASYNC_BATCH == 0){
+                    async_free_wake(1);
+                }
+                return 1;
             }
-            current = current->body.links.next;
+            // pos was reloaded by the failed compare-and-swap
+        } else if ((ptrdiff_t)(seq - pos) < 0){
+            // The slot still holds the block from one lap ago
+            return 0;
+        } else {
+            pos = __atomic_load_n(&async_free.tail, __ATOMIC_RELAXED);
         }
     }
-    // No block in the free lists could satisfy the size
-    return NULL;
 }
 
-void insert_free_list(sf_block *bp, int index){
-    set_block_flags(bp, 0 /*alloc*/, 0 /*quicklist*/);
-    // LIFO principle
-    bp->body.links.next = sf_free_list_heads[index].body.links.next;
-    bp->body.links.prev = &(sf_free_list_heads[index]);
-    sf_free_list_heads[index].body.links.next->body.links.prev = bp;
-    sf_free_list_heads[index].body.links.next = bp;
+/**
+ * Takes up to ASYNC_BATCH queued blocks, in queue order.  Returns how many.
+ */
+
+int async_free_pop(sf_block **batch){
+    int n = 0;
+    while (n < ASYNC_BATCH){
+        size_t pos = async_free.head;
+        sf_async_slot *slot = &async_free.slots[pos & async_free.mask];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1){
+            break;
+        }
+        batch[n++] = slot->bp;
+        // Empty again, for the producer one lap ahead
+        __atomic_store_n(&slot->seq, pos + async_free.mask + 1, __ATOMIC_RELEASE);
+        async_free.head = pos + 1;
+    }
+    return n;
 }
 
-void remove_from_free_list(sf_block *bp){
-    // Update the links of the previous / next block in free list
-    bp->body.links.next->body.links.prev = bp->body.links.prev;
-    bp->body.links.prev->body.links.next = bp->body.links.next;
+/**
+ * Whether the next slot to drain has been filled.
+ */
 
-    // Remove links to previous / next block in free list
-    bp->body.links.next = NULL;
-    bp->body.links.prev = NULL;
+int async_free_ready(){
+    sf_async_slot *slot = &async_free.slots[async_free.head & async_free.mask];
+    return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == async_free.head + 1;
+}
+
+/**
+ * Wakes the drainer if it is waiting: right away if it is idle, otherwise only if urgent
+ * (a full batch, a full queue, a flush or a stop), so that a steady stream of frees costs
+ * a wakeup per batch rather than per block.  The fence pairs with the one in
+ * async_free_sleep: either the drainer sees the slot just filled or this thread sees that
+ * it is asleep.
+ */
+
+void async_free_wake(int urgent){
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int sleeping = __atomic_load_n(&async_free.sleeping, __ATOMIC_RELAXED);
+    if ((sleeping == ASYNC_IDLE || (sleeping == ASYNC_LINGERING && urgent))
+        && __atomic_exchange_n(&async_free.sleeping, ASYNC_AWAKE, __ATOMIC_ACQ_REL) != ASYNC_AWAKE){
+        sem_post(&async_free.wake);
+    }
 }
 
-void insert_quick_list(sf_block *bp, int index){
-    // If exceed capacity, flush quicklist first
-    if (sf_quick_lists[index].length == QUICK_LIST_MAX){
-        for (int i = 0; i<QUICK_LIST_MAX; i++){
+/**
+ * Waits for blocks to drain.  The drainer first lingers for ASYNC_LINGER_NS, then goes
+ * idle until the next free if nothing arrived.  Whoever clears sleeping owns the wakeup:
+ * if a waker cleared it, a post is on its way and must be consumed.
+ */
 
-            sf_block *ptr = pop_quick_list(index);
-            // Coalesce
-            ptr = coalesce(ptr);
+void async_free_sleep(){
+    int state = ASYNC_LINGERING;
+    for (;;){
+        __atomic_store_n(&async_free.sleeping, state, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (async_free_ready() || __atomic_load_n(&async_free.stopping, __ATOMIC_ACQUIRE)){
+            if (__atomic_exchange_n(&async_free.sleeping, ASYNC_AWAKE, __ATOMIC_ACQ_REL) == ASYNC_AWAKE){
+                while (sem_wait(&async_free.wake) != 0 && errno == EINTR){
+                }
+            }
+            return;
+        }
+        if (state == ASYNC_IDLE){
+            while (sem_wait(&async_free.wake) != 0 && errno == EINTR){
+            }
+            return;
+        }
 
-            // Insert back to free_list
-            int size = GET_SIZE(&(ptr->header));
-            int f_index = freelist_index(size);
-            insert_free_list(ptr, f_index);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += ASYNC_LINGER_NS;
+        if (deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        int r;
+        while ((r = sem_timedwait(&async_free.wake, &deadline)) != 0 && errno == EINTR){
         }
+        if (r == 0){
+            return;
+        }
+        if (__atomic_exchange_n(&async_free.sleeping, ASYNC_AWAKE, __ATOMIC_ACQ_REL) == ASYNC_AWAKE){
+            while (sem_wait(&async_free.wake) != 0 && errno == EINTR){
+            }
+            return;
+        }
+        // Timed out with less than a batch queued, or nothing at all
+        if (async_free_ready()){
+            return;
+        }
+        state = ASYNC_IDLE;
     }
-    // Update flags
-    set_block_flags(bp, 1 /*alloc*/, 1 /*quicklist*/);
-    // LIFO principle
-    bp->body.links.next = sf_quick_lists[index].first;
-    sf_quick_lists[index].first = bp;
-    sf_quick_lists[index].length += 1;
-
 }
 
-sf_block *pop_quick_list(int index) {
-    if (sf_quick_lists[index].length == 0)
-        return NULL;
+/**
+ * The drainer thread.  Each batch is sorted by address and released under the caller's
+ * lock, so that blocks next to each other merge in one pass over the heap.
+ */
 
-    // Pop the first block
-    sf_block *bp = sf_quick_lists[index].first;
-    sf_quick_lists[index].first = bp->body.links.next;
-    sf_quick_lists[index].length--;
+void *async_free_drainer(void *arg){
+    sf_block *batch[ASYNC_BATCH];
+    for (;;){
+        int n = async_free_pop(batch);
+        if (n == 0){
+            if (!__atomic_load_n(&async_free.stopping, __ATOMIC_ACQUIRE)){
+                async_free_sleep();
+                continue;
+            }
+            // Everything queued before sf_async_free_stop is visible now
+            if ((n = async_free_pop(batch)) == 0){
+                return NULL;
+            }
+        }
+        for (int i = 1; i < n; i++){
+            sf_block *bp = batch[i];
+            int j = i;
+            for (; j > 0 && batch[j - 1] > bp; j--){
+                batch[j] = batch[j - 1];
+            }
+            batch[j] = bp;
+        }
+        if (async_free.lock != NULL){
+            async_free.lock(async_free.lock_arg);
+        }
+        for (int i = 0; i < n; i++){
+            set_block_meta_data(batch[i], 0, GET_SIZE(&(batch[i]->header)), UNLISTED);
+            release_block(&sf_default_heap, batch[i]);
+        }
+        if (async_free.unlock != NULL){
+            async_free.unlock(async_free.lock_arg);
+        }
+        __atomic_add_fetch(&async_free.drained, n, __ATOMIC_RELEASE);
+    }
+}
 
-    bp->body.links.next = NULL;
-    set_block_flags(bp, 0 /*free*/, 0 /*quicklist*/);
-    set_block_meta_data(bp, 0, GET_SIZE(&(bp->header)), 0);
+#ifdef SF_FINE_LOCKS
+/*
+    Fine-grained locking
+*/
 
-    return bp;
+/**
+ * The free list a free block is in, going by its header: the last one for the top chunk.
+ */
+
+int free_list_of(sf_block *bp){
+    if (GET(&(bp->header)) & TOP_CHUNK){
+        return sf_conf.free_lists - 1;
+    }
+    return freelist_index(GET_SIZE(&(bp->header)));
 }
 
-int freelist_index(int requested){
-    int size = MIN_BLOCK_SIZE, index = 0;
-    while (requested > size && index < (NUM_FREE_LISTS - 1)){
-        size *= 2;
-        index += 1;
+void lock_acquire(sf_lock *lock){
+    while (__atomic_exchange_n(&lock->held, 1, __ATOMIC_ACQUIRE)){
+        // Wait without writing to the lock's cache line
+        int spins = 0;
+        while (__atomic_load_n(&lock->held, __ATOMIC_RELAXED)){
+            if (++spins > LOCK_SPINS){
+                sched_yield();
+            }
+        }
     }
-    return index;
 }
 
-int quicklist_index(int size){
-    return (size - MIN_BLOCK_SIZE) / 16;
+void lock_release(sf_lock *lock){
+    __atomic_store_n(&lock->held, 0, __ATOMIC_RELEASE);
 }
+#endif
 
-size_t calculate_block_size(size_t size){
-    // Add overhead for header / footer
-    size_t result = size + 16;
+#ifdef SF_SIDE_TABLE
+/*
+    Side table
+*/
+
+void side_table_init(sf_side_table *side, char *base, uint64_t *words, size_t words_size){
+    side->base = base;
+    side->words = words;
+    // A fresh mapping is already zero
+    memset(words, 0, words_size);
+}
+
+/**
+ * Returns the side table covering a header address: the one of the segment that
+ * contains it, or the default heap's.
+ */
 
-    // Make it at least MIN_BLOCK_SIZE if less than
-    if (result < MIN_BLOCK_SIZE){
-        result = MIN_BLOCK_SIZE;
-    } else { // Round up to the nearest 16 multiple
-        if (result % 16 != 0) {
-            result += (16 - (result % 16));
+sf_side_table *side_table_of(void *p){
+    if (segment_count > 0){
+        sf_segment_range *range = find_segment(p);
+        if (range != NULL){
+            return &((sf_segment *)range->start)->side;
         }
     }
-    return result;
+    return &default_side;
 }
 
-int valid_pointer(sf_block *p){
-    // ptr is NULL
-    if (p == NULL) return 0;
-    // ptr is not 16 byte aligned
-    //if ((uintptr_t)p % 16) return 0;
+/**
+ * Records a block of the given size starting at header address hp.  Starts inside it
+ * belonged to the blocks it absorbed and are cleared.  The epilogue is marked before
+ * any block, so the search for the next start always ends at it.
+ */
 
-    // ptr is before prologue
-    //if ((char *)p < (char *)sf_mem_start() + 40) return 0;
-    // ptr is after epilogue
-    //if ((char *)p > (char *)sf_mem_end() - 8) return 0;
+void side_mark(void *hp, size_t size, int alloc){
+    sf_side_table *side = side_table_of(hp);
+    size_t g = SIDE_GRANULE(side, hp);
+    size_t to = g + size / DSIZE;
+    if (size > 0){
+        size_t from = side_next_start(side, g);
+        while (from < to){
+            size_t bit = from % 64;
+            size_t n = to - from < 64 - bit ? to - from : 64 - bit;
+            uint64_t mask = n == 64 ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1) << bit;
+            SIDE_STARTS(side, from) &= ~mask;
+            from += n;
+        }
+    }
+    SIDE_STARTS(side, g) |= SIDE_BIT(g);
+    if (alloc){
+        SIDE_ALLOC(side, g) |= SIDE_BIT(g);
+    } else {
+        SIDE_ALLOC(side, g) &= ~SIDE_BIT(g);
+    }
+}
 
-    size_t header = GET(&(p->header));
-    size_t size = header & ~0xF;
+/**
+ * Size of the block whose header is at hp: the distance to the next start, or 0 for the
+ * epilogue.
+ */
 
-    // Must be at least MIN_BLOCK_SIZE
-    if (size < MIN_BLOCK_SIZE) return 0;
+size_t side_block_size(void *hp){
+    sf_side_table *side = &default_side;
+    char *epilogue = (char *)sf_mem_end() - WSIZE;
+    if (segment_count > 0){
+        sf_segment_range *range = find_segment(hp);
+        if (range != NULL){
+            sf_segment *seg = (sf_segment *)range->start;
+            side = &seg->side;
+            epilogue = (char *)seg + seg->size - WSIZE;
+        }
+    }
+    if ((char *)hp >= epilogue){
+        return 0;
+    }
+    size_t g = SIDE_GRANULE(side, hp);
+    return (side_next_start(side, g) - g) * DSIZE;
+}
 
-    // Must be 16 byte aligned
-    if (size % 16 != 0) return 0;
+void side_set_alloc(void *hp, int alloc){
+    sf_side_table *side = side_table_of(hp);
+    size_t g = SIDE_GRANULE(side, hp);
+    if (alloc){
+        SIDE_ALLOC(side, g) |= SIDE_BIT(g);
+    } else {
+        SIDE_ALLOC(side, g) &= ~SIDE_BIT(g);
+    }
+}
 
-    return 1;
-}
\ No newline at end of file
+/**
+ * Finds the next / previous block start around granule g.  The epilogue and the
+ * prologue are starts too, so the scans stop inside the heap.
+ */
+
+size_t side_next_start(sf_side_table *side, size_t g){
+    g++;
+    uint64_t bits = SIDE_STARTS(side, g) & (~(uint64_t)0 << (g % 64));
+    g -= g % 64;
+    while (bits == 0){
+        g += 64;
+        bits = SIDE_STARTS(side, g);
+    }
+    return g + __builtin_ctzll(bits);
+}
+
+size_t side_prev_start(sf_side_table *side, size_t g){
+    g--;
+    uint64_t bits = SIDE_STARTS(side, g) & (~(uint64_t)0 >> (63 - g % 64));
+    g -= g % 64;
+    while (bits == 0){
+        g -= 64;
+        bits = SIDE_STARTS(side, g);
+    }
+    return g + 63 - __builtin_clzll(bits);
+}
+#endif
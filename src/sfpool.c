@@ -0,0 +1,255 @@
+/**
+ * Fixed-size object pools on top of the heap.
+ *
+ * A pool carves objects of one size out of chunks, which are blocks of the
+ * default heap aligned to their own size.  That alignment lets sf_pool_free
+ * find the chunk of an object by masking its address, so objects need no
+ * header of their own and are packed at their (aligned) size instead of being
+ * rounded up to a block size.  Free objects are kept on an intrusive list in
+ * their chunk; objects that were never handed out are carved lazily.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+#define POOL_CHUNK_SIZE (4 * PAGE_SZ)
+#define POOL_MIN_OBJECTS 8
+#define POOL_BLOCK_OVERHEAD 16
+// Like a quick list: recently freed objects are reused before touching their chunk
+#define POOL_CACHE_MAX 8
+
+typedef struct sf_pool_object {
+    struct sf_pool_object *next;
+} sf_pool_object;
+
+typedef struct sf_pool_chunk {
+    sf_pool_t *pool;
+    struct sf_pool_chunk *next;     // Neighbors on the partial or full list.
+    struct sf_pool_chunk *prev;
+    sf_pool_object *free;           // Objects that were freed.
+    char *carve;                    // Objects that were never handed out start here.
+    size_t in_use;
+} sf_pool_chunk;
+
+struct sf_pool {
+    size_t obj_size;
+    size_t stride;                  // obj_size rounded up to the alignment.
+    size_t chunk_size;              // Power of two; chunks are aligned to it.
+    size_t first_offset;            // Offset of the first object in a chunk.
+    size_t per_chunk;
+    sf_pool_chunk *partial;         // Chunks with at least one free object.
+    sf_pool_chunk *full;
+    size_t chunks;
+    int cached;
+    void *cache[POOL_CACHE_MAX];
+};
+
+#define CHUNK_OF(pool, ptr) ((sf_pool_chunk *)((uintptr_t)(ptr) & ~(uintptr_t)((pool)->chunk_size - 1)))
+
+static sf_pool_chunk *new_chunk(sf_pool_t *pool);
+static void release_chunk(sf_pool_t *pool, sf_pool_chunk *chunk);
+static void flush_cache(sf_pool_t *pool);
+static void chunk_free(sf_pool_t *pool, void *ptr);
+static void link_chunk(sf_pool_chunk **list, sf_pool_chunk *chunk);
+static void unlink_chunk(sf_pool_chunk **list, sf_pool_chunk *chunk);
+
+sf_pool_t *sf_pool_create(size_t obj_size, size_t align) {
+    if (align == 0){
+        align = sizeof(void *);
+    }
+    if ((align & (align - 1)) != 0 || align > PAGE_SZ){
+        sf_errno = EINVAL;
+        return NULL;
+    }
+    if (align < sizeof(void *)){
+        align = sizeof(void *);
+    }
+    // A free object holds the link of the freelist
+    if (obj_size < sizeof(sf_pool_object)){
+        obj_size = sizeof(sf_pool_object);
+    }
+    if (obj_size > POOL_CHUNK_SIZE){
+        // Beyond this the pool saves nothing over sf_malloc
+        sf_errno = EINVAL;
+        return NULL;
+    }
+
+    sf_pool_t *pool = sf_malloc(sizeof(sf_pool_t));
+    if (pool == NULL){
+        return NULL;
+    }
+    pool->obj_size = obj_size;
+    pool->stride = (obj_size + align - 1) & ~(align - 1);
+    pool->first_offset = (sizeof(sf_pool_chunk) + align - 1) & ~(align - 1);
+
+    // Grow the chunk until it holds enough objects to amortize its header
+    pool->chunk_size = POOL_CHUNK_SIZE;
+    while ((pool->chunk_size - POOL_BLOCK_OVERHEAD - pool->first_offset) / pool->stride < POOL_MIN_OBJECTS){
+        pool->chunk_size *= 2;
+    }
+    pool->per_chunk = (pool->chunk_size - POOL_BLOCK_OVERHEAD - pool->first_offset) / pool->stride;
+    pool->partial = NULL;
+    pool->full = NULL;
+    pool->chunks = 0;
+    pool->cached = 0;
+    return pool;
+}
+
+void sf_pool_destroy(sf_pool_t *pool) {
+    if (pool == NULL){
+        return;
+    }
+    pool->cached = 0;
+    while (pool->partial != NULL){
+        release_chunk(pool, pool->partial);
+    }
+    while (pool->full != NULL){
+        release_chunk(pool, pool->full);
+    }
+    sf_free(pool);
+}
+
+void *sf_pool_alloc(sf_pool_t *pool) {
+    if (pool->cached > 0){
+        return pool->cache[--pool->cached];
+    }
+
+    sf_pool_chunk *chunk = pool->partial;
+    if (chunk == NULL){
+        chunk = new_chunk(pool);
+        if (chunk == NULL){
+            return NULL;
+        }
+    }
+
+    sf_pool_object *obj = chunk->free;
+    if (obj != NULL){
+        chunk->free = obj->next;
+    } else {
+        obj = (sf_pool_object *)chunk->carve;
+        chunk->carve += pool->stride;
+    }
+    if (++chunk->in_use == pool->per_chunk){
+        unlink_chunk(&pool->partial, chunk);
+        link_chunk(&pool->full, chunk);
+    }
+    return obj;
+}
+
+void sf_pool_free(sf_pool_t *pool, void *ptr) {
+    if (ptr == NULL){
+        return;
+    }
+    if (CHUNK_OF(pool, ptr)->pool != pool){
+        abort();
+    }
+    // If the cache is full, flush it first
+    if (pool->cached == POOL_CACHE_MAX){
+        flush_cache(pool);
+    }
+    pool->cache[pool->cached++] = ptr;
+}
+
+void sf_pool_trim(sf_pool_t *pool) {
+    flush_cache(pool);
+    sf_pool_chunk *chunk = pool->partial;
+    while (chunk != NULL){
+        sf_pool_chunk *next = chunk->next;
+        if (chunk->in_use == 0){
+            release_chunk(pool, chunk);
+        }
+        chunk = next;
+    }
+}
+
+void sf_pool_stats(sf_pool_t *pool, sf_pool_stats_t *stats) {
+    stats->object_size = pool->obj_size;
+    stats->chunks = pool->chunks;
+    stats->capacity = pool->chunks * pool->per_chunk;
+    // Counted here rather than on every alloc and free; the chunks count cached objects as in use
+    size_t taken = 0;
+    for (sf_pool_chunk *chunk = pool->partial; chunk != NULL; chunk = chunk->next){
+        taken += chunk->in_use;
+    }
+    for (sf_pool_chunk *chunk = pool->full; chunk != NULL; chunk = chunk->next){
+        taken += chunk->in_use;
+    }
+    stats->in_use = taken - pool->cached;
+    stats->heap_bytes = pool->chunks * pool->chunk_size;
+}
+
+/**
+ * Returns the cached objects to their chunks.
+ */
+
+static void flush_cache(sf_pool_t *pool) {
+    while (pool->cached > 0){
+        chunk_free(pool, pool->cache[--pool->cached]);
+    }
+}
+
+static void chunk_free(sf_pool_t *pool, void *ptr) {
+    sf_pool_chunk *chunk = CHUNK_OF(pool, ptr);
+    if (chunk->in_use == 0){
+        abort();
+    }
+
+    sf_pool_object *obj = ptr;
+    obj->next = chunk->free;
+    chunk->free = obj;
+
+    if (chunk->in_use-- == pool->per_chunk){
+        unlink_chunk(&pool->full, chunk);
+        link_chunk(&pool->partial, chunk);
+    } else if (chunk->in_use == 0 && (pool->partial != chunk || chunk->next != NULL)){
+        // Give an empty chunk back, unless it is the last one with room
+        release_chunk(pool, chunk);
+    }
+}
+
+/**
+ * Gets a chunk from the heap, aligned to its size so that the payload fills
+ * the aligned window exactly, and puts it on the partial list.
+ */
+
+static sf_pool_chunk *new_chunk(sf_pool_t *pool) {
+    sf_pool_chunk *chunk = sf_memalign(pool->chunk_size, pool->chunk_size - POOL_BLOCK_OVERHEAD);
+    if (chunk == NULL){
+        return NULL;
+    }
+    chunk->pool = pool;
+    chunk->free = NULL;
+    chunk->carve = (char *)chunk + pool->first_offset;
+    chunk->in_use = 0;
+    link_chunk(&pool->partial, chunk);
+    pool->chunks++;
+    return chunk;
+}
+
+static void release_chunk(sf_pool_t *pool, sf_pool_chunk *chunk) {
+    unlink_chunk(chunk->in_use == pool->per_chunk ? &pool->full : &pool->partial, chunk);
+    pool->chunks--;
+    sf_free(chunk);
+}
+
+static void link_chunk(sf_pool_chunk **list, sf_pool_chunk *chunk) {
+    chunk->prev = NULL;
+    chunk->next = *list;
+    if (*list != NULL){
+        (*list)->prev = chunk;
+    }
+    *list = chunk;
+}
+
+static void unlink_chunk(sf_pool_chunk **list, sf_pool_chunk *chunk) {
+    if (chunk->prev != NULL){
+        chunk->prev->next = chunk->next;
+    } else {
+        *list = chunk->next;
+    }
+    if (chunk->next != NULL){
+        chunk->next->prev = chunk->prev;
+    }
+}
@@ -0,0 +1,141 @@
+/**
+ * Region (arena) allocator on top of the heap.
+ *
+ * A region hands out memory by bumping a cursor through large chunks, which
+ * are ordinary blocks of a heap.  Objects have no header or footer and are
+ * never freed one by one: sf_region_reset rewinds the cursor and
+ * sf_region_destroy gives the chunks back to the heap as whole blocks.
+ */
+#include <errno.h>
+#include <stdint.h>
+#include "sfmm.h"
+#include "sfmm_ext.h"
+
+#define REGION_ALIGN 16
+// Payload size that makes a chunk's block exactly this many pages
+#define REGION_CHUNK_PAGES 4
+#define REGION_BLOCK_OVERHEAD 16
+
+typedef struct sf_region_chunk {
+    struct sf_region_chunk *next;   // Next chunk; chunks after current are spares after a reset.
+    size_t size;                    // Bytes available after this record.
+} sf_region_chunk;
+
+/*
+ * The region itself lives at the start of its first chunk, right after the
+ * chunk record, so creating a region costs one heap allocation.
+ */
+struct sf_region {
+    sf_heap_t *heap;
+    sf_region_chunk *first;
+    sf_region_chunk *current;
+    char *cursor;
+    char *limit;
+};
+
+#define ROUND_UP(n) (((n) + REGION_ALIGN - 1) & ~(size_t)(REGION_ALIGN - 1))
+#define CHUNK_DATA(c) ((char *)(c) + ROUND_UP(sizeof(sf_region_chunk)))
+#define FIRST_DATA(c) (CHUNK_DATA(c) + ROUND_UP(sizeof(struct sf_region)))
+
+static sf_region_chunk *new_chunk(sf_heap_t *heap, size_t needed);
+static void *next_chunk_alloc(sf_region_t *region, size_t size);
+
+sf_region_t *sf_region_create(sf_heap_t *heap) {
+    sf_region_chunk *chunk = new_chunk(heap, ROUND_UP(sizeof(struct sf_region)));
+    if (chunk == NULL){
+        return NULL;
+    }
+    sf_region_t *region = (sf_region_t *)CHUNK_DATA(chunk);
+    region->heap = heap;
+    region->first = chunk;
+    sf_region_reset(region);
+    return region;
+}
+
+void *sf_region_alloc(sf_region_t *region, size_t size) {
+    if (size == 0){
+        return NULL;
+    }
+    if (size > SIZE_MAX - REGION_ALIGN){
+        sf_errno = ENOMEM;
+        return NULL;
+    }
+    size = ROUND_UP(size);
+
+    // Fast path: bump the cursor inside the current chunk
+    if (size <= (size_t)(region->limit - region->cursor)){
+        void *ptr = region->cursor;
+        region->cursor += size;
+        return ptr;
+    }
+    return next_chunk_alloc(region, size);
+}
+
+void sf_region_reset(sf_region_t *region) {
+    // Chunks after the first are kept as spares and reused by later allocations
+    region->current = region->first;
+    region->cursor = FIRST_DATA(region->first);
+    region->limit = CHUNK_DATA(region->first) + region->first->size;
+}
+
+void sf_region_destroy(sf_region_t *region) {
+    if (region == NULL){
+        return;
+    }
+    sf_heap_t *heap = region->heap;
+    sf_region_chunk *first = region->first;
+    sf_region_chunk *chunk = first->next;
+    while (chunk != NULL){
+        sf_region_chunk *next = chunk->next;
+        sf_heap_free(heap, chunk);
+        chunk = next;
+    }
+    // The region is stored in the first chunk, so it goes last
+    sf_heap_free(heap, first);
+}
+
+/**
+ * Allocates a chunk with room for at least needed bytes of objects.
+ */
+
+static sf_region_chunk *new_chunk(sf_heap_t *heap, size_t needed) {
+    size_t header = ROUND_UP(sizeof(sf_region_chunk));
+    size_t payload = REGION_CHUNK_PAGES * PAGE_SZ - REGION_BLOCK_OVERHEAD;
+    if (needed > payload - header){
+        if (needed > SIZE_MAX - header - PAGE_SZ){
+            sf_errno = ENOMEM;
+            return NULL;
+        }
+        // Oversized objects get a chunk of their own, still a whole number of pages
+        payload = ((needed + header + REGION_BLOCK_OVERHEAD + PAGE_SZ - 1) & ~(size_t)(PAGE_SZ - 1))
+                  - REGION_BLOCK_OVERHEAD;
+    }
+    sf_region_chunk *chunk = sf_heap_malloc(heap, payload);
+    if (chunk == NULL){
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = payload - header;
+    return chunk;
+}
+
+/**
+ * Slow path of sf_region_alloc: moves on to the next spare chunk if it is large
+ * enough, otherwise links a new chunk in right after the current one.
+ */
+
+static void *next_chunk_alloc(sf_region_t *region, size_t size) {
+    sf_region_chunk *chunk = region->current->next;
+    if (chunk == NULL || chunk->size < size){
+        chunk = new_chunk(region->heap, size);
+        if (chunk == NULL){
+            return NULL;
+        }
+        chunk->next = region->current->next;
+        region->current->next = chunk;
+    }
+    region->current = chunk;
+    region->cursor = CHUNK_DATA(chunk) + size;
+    region->limit = CHUNK_DATA(chunk) + chunk->size;
+    return CHUNK_DATA(chunk);
+}
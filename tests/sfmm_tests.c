@@ -1,10 +1,29 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
 #include <criterion/criterion.h>
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
+#include <string.h>
+#include <unistd.h>
 #include "debug.h"
 #include "sfmm.h"
+#include "sfmm_ext.h"
+#include "sfdump.h"
 #define TEST_TIMEOUT 15
 
+/*
+ * Blocks have no footer with the side table: a request of SZ(n) bytes gets the block there
+ * that n bytes get otherwise, and BLOCK_OVERHEAD bytes of a block are not usable.
+ */
+#ifdef SF_SIDE_TABLE
+#define SZ(n) ((n) + 8)
+#define BLOCK_OVERHEAD 8
+#else
+#define SZ(n) (n)
+#define BLOCK_OVERHEAD 16
+#endif
+
 /*
  * Assert the total number of free blocks of a specified size.
  * If size == 0, then assert the total number of all free blocks.
@@ -111,7 +130,7 @@ Test(sfmm_basecode_suite, free_quick, .timeout = TEST_TIMEOUT) {
 
 Test(sfmm_basecode_suite, free_no_coalesce, .timeout = TEST_TIMEOUT) {
 	sf_errno = 0;
-	size_t sz_x = 8, sz_y = 200, sz_z = 1;
+	size_t sz_x = 8, sz_y = SZ(200), sz_z = 1;
 	/* void *x = */ sf_malloc(sz_x);
 	void *y = sf_malloc(sz_y);
 	/* void *z = */ sf_malloc(sz_z);
@@ -128,7 +147,7 @@ Test(sfmm_basecode_suite, free_no_coalesce, .timeout = TEST_TIMEOUT) {
 
 Test(sfmm_basecode_suite, free_coalesce, .timeout = TEST_TIMEOUT) {
 	sf_errno = 0;
-	size_t sz_w = 8, sz_x = 200, sz_y = 300, sz_z = 4;
+	size_t sz_w = 8, sz_x = SZ(200), sz_y = SZ(300), sz_z = 4;
 	/* void *w = */ sf_malloc(sz_w);
 	void *x = sf_malloc(sz_x);
 	void *y = sf_malloc(sz_y);
@@ -146,7 +165,8 @@ Test(sfmm_basecode_suite, free_coalesce, .timeout = TEST_TIMEOUT) {
 }
 
 Test(sfmm_basecode_suite, freelist, .timeout = TEST_TIMEOUT) {
-        size_t sz_u = 200, sz_v = 300, sz_w = 200, sz_x = 500, sz_y = 200, sz_z = 700;
+        size_t sz_u = SZ(200), sz_v = SZ(300), sz_w = SZ(200), sz_x = SZ(500), sz_y = SZ(200),
+	       sz_z = SZ(700);
 	void *u = sf_malloc(sz_u);
 	/* void *v = */ sf_malloc(sz_v);
 	void *w = sf_malloc(sz_w);
@@ -278,8 +298,8 @@ Test(sfmm_student_suite, student_test_2, .timeout = TEST_TIMEOUT) {
 }
 
 Test(sfmm_student_suite, student_test_3, .timeout = TEST_TIMEOUT) {
-	size_t *a = sf_malloc(1000);
-	size_t *b = sf_malloc(2000);
+	size_t *a = sf_malloc(SZ(1000));
+	size_t *b = sf_malloc(SZ(2000));
 	
 	*a = 2000;
 	*b = 2000;
@@ -309,8 +329,8 @@ Test(sfmm_student_suite, student_test_4, .timeout = TEST_TIMEOUT) {
 
 Test(sfmm_student_suite, student_test_5, .timeout = TEST_TIMEOUT) {
 	// realloc larger block
-	size_t *a = sf_malloc(60);
-	sf_realloc(a, 100);
+	size_t *a = sf_malloc(SZ(60));
+	sf_realloc(a, SZ(100));
 
 	// Old block in quicklist: 60 + 12 (overhead) + 8 (for 16 byte alignment)
 	assert_quick_list_block_count(0, 1);
@@ -320,3 +340,759 @@ Test(sfmm_student_suite, student_test_5, .timeout = TEST_TIMEOUT) {
 	assert_free_block_count(3840, 1);
 }
 
+Test(sfmm_student_suite, memalign_aligned_block, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_memalign(256, 300);
+
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert(((uintptr_t)x & 255) == 0, "Payload %p is not 256-byte aligned!", x);
+
+	sf_block *bp = (sf_block *)((char *)x - 8);
+	cr_assert((bp->header ^ sf_magic()) & 0x1, "Allocated bit is not set!");
+	cr_assert(((bp->header ^ sf_magic()) & ~0xffffffff0000000f) == 320,
+		  "Aligned block size (%ld) not what was expected (%ld)!",
+		  (bp->header ^ sf_magic()) & ~0xffffffff0000000f, 320);
+
+	// Both the gap in front and the tail coalesce back with the block
+	sf_free(x);
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(4048, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, memalign_invalid_alignment, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_memalign(24, 10);
+
+	cr_assert_null(x, "x is not NULL!");
+	cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
+}
+
+Test(sfmm_student_suite, usable_size, .timeout = TEST_TIMEOUT) {
+	// 50 + 16 (overhead) rounds up to an 80 byte block
+	void *x = sf_malloc(SZ(50));
+
+	cr_assert_eq(sf_malloc_usable_size(x), 80 - BLOCK_OVERHEAD, "Wrong usable size (exp=%d, found=%ld)",
+		     80 - BLOCK_OVERHEAD, sf_malloc_usable_size(x));
+	cr_assert_eq(sf_malloc_usable_size(NULL), 0, "Usable size of NULL is not 0!");
+}
+
+Test(sfmm_student_suite, good_size_and_malloc_sized, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert_eq(sf_good_size(SZ(50)), 80 - BLOCK_OVERHEAD, "Wrong good size (exp=%d, found=%ld)",
+		     80 - BLOCK_OVERHEAD, sf_good_size(SZ(50)));
+	cr_assert_eq(sf_good_size(0), 0, "Good size of 0 is not 0!");
+
+	// A free 320 byte block serves a 304 byte request whole, since 16 bytes cannot be split off
+	void *x = sf_malloc(SZ(300));
+	void *y = sf_malloc(8);
+	cr_assert_not_null(y, "y is NULL!");
+	sf_free(x);
+	cr_assert_eq(sf_good_size(SZ(280)), 304 - BLOCK_OVERHEAD, "Wrong good size (exp=%d, found=%ld)",
+		     304 - BLOCK_OVERHEAD, sf_good_size(SZ(280)));
+
+	sf_sized_ptr_t z = sf_malloc_sized(SZ(280));
+	cr_assert_eq(z.ptr, x, "Free block was not reused!");
+	cr_assert_eq(z.size, 320 - BLOCK_OVERHEAD, "Wrong sized result (exp=%d, found=%ld)",
+		     320 - BLOCK_OVERHEAD, z.size);
+	cr_assert_eq(sf_malloc_usable_size(z.ptr), z.size, "Usable size does not match!");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, cpu_cache_round_trip, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_cpu_cache_refill(SZ(40));
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert_eq(sf_malloc_usable_size(x), 64 - BLOCK_OVERHEAD, "Wrong usable size (exp=%d, found=%ld)",
+		     64 - BLOCK_OVERHEAD, sf_malloc_usable_size(x));
+	cr_assert_eq(sf_cpu_cache_free(sf_malloc(1000)), 0, "Large block was cached!");
+
+	// Without rseq nothing is ever cached and the caller falls back to the heap
+	if (sf_cpu_cache_free(x)){
+		cr_assert_eq(sf_cpu_cache_alloc(SZ(33)), x, "Cached block was not reused!");
+	}
+	else {
+		cr_assert_null(sf_cpu_cache_alloc(SZ(33)), "Block cached without rseq!");
+		sf_cpu_cache_drain(x);
+	}
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#include <sys/syscall.h>
+
+static void *cpu_cache_unregistered_worker(void *arg) {
+	struct rseq *rs = (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+	// The C library registers at least sizeof(struct rseq) bytes, and unregistering must match
+	size_t len = __rseq_size > sizeof(struct rseq) ? __rseq_size : sizeof(struct rseq);
+	if (syscall(SYS_rseq, rs, len, RSEQ_FLAG_UNREGISTER, RSEQ_SIG) != 0)
+		return arg;		// Nothing to check if the area cannot be unregistered
+	// The caches must be bypassed rather than retried forever
+	void *cached = sf_cpu_cache_free(arg) ? arg : NULL;
+	void *popped = sf_cpu_cache_alloc(SZ(33));
+	return cached == NULL && popped == NULL ? arg : NULL;
+}
+
+Test(sfmm_student_suite, cpu_cache_unregistered_thread, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x = sf_cpu_cache_refill(40);
+	cr_assert_not_null(x, "x is NULL!");
+	if (!sf_cpu_cache_free(x))
+		return;		// No rseq in this process
+	x = sf_cpu_cache_alloc(33);
+	pthread_t thread;
+	void *result;
+	pthread_create(&thread, NULL, cpu_cache_unregistered_worker, x);
+	pthread_join(thread, &result);
+	cr_assert_eq(result, x, "Thread without rseq used the caches!");
+	sf_free(x);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+#endif
+#endif
+
+#if defined(SF_META_HARDENED) && !defined(SF_SIDE_TABLE)
+Test(sfmm_student_suite, hardened_footer_overrun, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+	// 24 + 16 (overhead) rounds up to a 48 byte block, so the footer starts 32 bytes in
+	char *x = sf_malloc(24);
+	memset(x, 0x41, 40);
+	sf_free(x);
+}
+#endif
+
+#ifdef SF_SIDE_TABLE
+Test(sfmm_student_suite, side_table_overrun_keeps_sizes, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	// 24 + 8 (header) is a 32 byte block, so the next block's header starts 24 bytes in
+	char *x = sf_malloc(24);
+	char *y = sf_malloc(24);
+	cr_assert_eq(y, x + 32, "Blocks are not adjacent!");
+	memset(x, 0x41, 32);
+
+	// Sizes come from the side table, so neither block changed shape
+	sf_free(x);
+	assert_quick_list_block_count(32, 1);
+	cr_assert_eq(sf_malloc(24), x, "Block was not reused!");
+	cr_assert_eq(sf_malloc(24), y + 32, "Overrun moved the end of the next block!");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+#ifdef SF_META_HARDENED
+Test(sfmm_student_suite, side_table_overrun_caught, .timeout = TEST_TIMEOUT, .signal = SIGABRT) {
+	char *x = sf_malloc(24);
+	char *y = sf_malloc(24);
+	memset(x, 0x41, 32);
+	// The header of y no longer matches the side table
+	sf_free(y);
+}
+#endif
+
+Test(sfmm_student_suite, side_table_ignores_forged_neighbor, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	// 208 + 8 rounds up to 224 bytes, past the quick lists
+	char *x = sf_malloc(SZ(200));
+	char *y = sf_malloc(SZ(200));
+	void *z = sf_malloc(8);
+	cr_assert_not_null(z, "z is NULL!");
+
+	// Clear the allocated bit in y's header, as an overrun might
+	sf_header *yh = (sf_header *)(y - sizeof(sf_header));
+	*yh = ((*yh ^ sf_magic()) & ~(sf_header)THIS_BLOCK_ALLOCATED) ^ sf_magic();
+
+	// Coalescing asks the side table, so x is not merged into the live y
+	sf_free(x);
+	assert_free_block_count(224, 1);
+	assert_free_block_count(448, 0);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+#endif
+
+#ifdef SF_FINE_LOCKS
+static void *fine_locks_worker(void *arg) {
+	unsigned int seed = (unsigned int)(long)arg;
+	char *slots[16] = { NULL };
+	for (int n = 0; n < 20000; n++) {
+		int i = rand_r(&seed) % 16;
+		if (slots[i] != NULL) {
+			cr_assert_eq(slots[i][0], (char)i, "Block was overwritten!");
+			sf_free(slots[i]);
+			slots[i] = NULL;
+		} else {
+			// Small sizes go through the quick lists, the larger ones through coalescing
+			slots[i] = sf_malloc(rand_r(&seed) % 2 ? 8 + rand_r(&seed) % 150 : 200 + rand_r(&seed) % 600);
+			cr_assert_not_null(slots[i], "Allocation failed!");
+			slots[i][0] = (char)i;
+		}
+	}
+	for (int i = 0; i < 16; i++) {
+		if (slots[i] != NULL) {
+			sf_free(slots[i]);
+		}
+	}
+	return NULL;
+}
+
+Test(sfmm_student_suite, fine_locks_placement_keeps_top, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *a = sf_malloc(300);
+	sf_malloc(10);
+	void *c = sf_malloc(600);
+	sf_malloc(10);
+	sf_free(a);
+	sf_free(c);
+	cr_assert_eq(sf_heap_set_placement(NULL, SF_ADDRESS_FIT, 0), 0, "Setting address order failed!");
+
+	// The block before the epilogue is still flagged as the top chunk, last in the last list
+	char *end = (char *)sf_mem_end() - 8;
+	size_t size = (*(sf_header *)(end - 8) ^ sf_magic()) & ~0xffffffff0000000f;
+	sf_block *top = (sf_block *)(end - size);
+	cr_assert((top->header ^ sf_magic()) & 0x8, "Top chunk lost its flag!");
+	cr_assert_eq(sf_free_list_heads[NUM_FREE_LISTS - 1].body.links.prev, top, "Top chunk is not last!");
+
+	// Coalescing with the top chunk takes the lock of the list it is really in
+	pthread_t threads[4];
+	for (long i = 0; i < 4; i++) {
+		pthread_create(&threads[i], NULL, fine_locks_worker, (void *)(i + 1));
+	}
+	for (int i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, fine_locks_concurrent_threads, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	pthread_t threads[4];
+	for (long i = 0; i < 4; i++) {
+		pthread_create(&threads[i], NULL, fine_locks_worker, (void *)(i + 1));
+	}
+	for (int i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// Every block is free again, either listed or in a quick list, and intact
+	int free_blocks = 0, quick_blocks = 0;
+	char *end = (char *)sf_mem_end() - 8;
+	for (char *bp = (char *)sf_mem_start() + 40; bp < end; ) {
+		sf_header header = *(sf_header *)bp ^ sf_magic();
+		size_t size = header & ~0xffffffff0000000f;
+		cr_assert(size >= 32 && bp + size <= end, "Bad block size %ld!", size);
+		cr_assert_eq(*(sf_header *)(bp + size - 8) ^ sf_magic(), header, "Footer does not match header!");
+		cr_assert((header & 0x1) == 0 || (header & 0x2) != 0, "Block still allocated!");
+		if (header & 0x1) {
+			quick_blocks++;
+		} else {
+			free_blocks++;
+		}
+		bp += size;
+	}
+	assert_free_block_count(0, free_blocks);
+	assert_quick_list_block_count(0, quick_blocks);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+#endif
+
+static pthread_mutex_t async_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void async_lock_heap(void *arg) {
+	pthread_mutex_lock(&async_heap_lock);
+}
+
+static void async_unlock_heap(void *arg) {
+	pthread_mutex_unlock(&async_heap_lock);
+}
+
+Test(sfmm_student_suite, async_free_coalesces_in_background, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert_eq(sf_async_free_start(3, async_lock_heap, async_unlock_heap, NULL), -1,
+		     "Depth 3 was accepted!");
+	cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
+#ifndef SF_FINE_LOCKS
+	cr_assert_eq(sf_async_free_start(8, NULL, NULL, NULL), -1, "Missing lock was accepted!");
+	cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
+#endif
+	sf_errno = 0;
+	cr_assert_eq(sf_async_free_start(8, async_lock_heap, async_unlock_heap, NULL), 0,
+		     "Starting asynchronous free failed!");
+
+	void *x[4];
+	async_lock_heap(NULL);
+	for (int i = 0; i < 4; i++)
+		x[i] = sf_malloc(400);
+	sf_malloc(10);
+	// Out of address order, so the background thread has to merge them
+	sf_free(x[2]);
+	sf_free(x[0]);
+	sf_free(x[3]);
+	sf_free(x[1]);
+	async_unlock_heap(NULL);
+	sf_async_free_flush();
+
+	assert_free_block_count(4 * 416, 1);
+	sf_async_free_stop();
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+#ifndef SF_SIDE_TABLE
+Test(sfmm_student_suite, persistent_heap_reopens_with_root, .timeout = TEST_TIMEOUT) {
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/sfmm_pheap_test.%d", (int)getpid());
+	unlink(path);
+	sf_errno = 0;
+	sf_heap_t *heap = sf_pheap_open(path, 16 * PAGE_SZ, NULL);
+	cr_assert_not_null(heap, "Creating the persistent heap failed!");
+
+	char **objects = sf_heap_malloc(heap, 4 * sizeof(char *));
+	for (int i = 0; i < 4; i++) {
+		objects[i] = sf_heap_malloc(heap, 100);
+		snprintf(objects[i], 100, "object %d", i);
+	}
+	char *freed = objects[1];
+	sf_heap_free(heap, freed);
+	objects[1] = NULL;
+	cr_assert_eq(sf_pheap_set_root(heap, objects), 0, "Setting the root failed!");
+	cr_assert_eq(sf_pheap_set_root(heap, path), -1, "A root outside the heap was accepted!");
+	cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
+	sf_errno = 0;
+	cr_assert_eq(sf_pheap_close(heap), 0, "Closing the persistent heap failed!");
+
+	// Same address, same objects, and the quick list still holds the freed block
+	heap = sf_pheap_open(path, 0, NULL);
+	cr_assert_not_null(heap, "Reopening the persistent heap failed!");
+	objects = sf_pheap_root(heap);
+	cr_assert_not_null(objects, "The root was lost!");
+	cr_assert(objects[1] == NULL && strcmp(objects[3], "object 3") == 0, "Objects were not kept!");
+	char *x = sf_heap_malloc(heap, 100);
+	cr_assert_eq(x, freed, "Quick list was not kept (exp=%p, found=%p)", freed, x);
+	sf_free(objects[3]);
+	cr_assert_eq(sf_pheap_close(heap), 0, "Closing the persistent heap failed!");
+	unlink(path);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+#endif
+
+Test(sfmm_student_suite, handles_compact_toward_start, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_handle_t h[6];
+	char *at[6];
+	for (int i = 0; i < 6; i++) {
+		h[i] = sf_halloc(SZ(200));
+		cr_assert_neq(h[i], 0, "sf_halloc failed!");
+		at[i] = sf_hpin(h[i]);
+		memset(at[i], 'a' + i, 200);
+		sf_hunpin(h[i]);
+	}
+	sf_hfree(h[0]);
+	sf_hfree(h[1]);
+	char *pinned = sf_hpin(h[5]);
+
+	// Everything but the pinned object slides down by two blocks
+	cr_assert_eq(sf_hcompact(0), 3 * 240, "Wrong number of bytes moved!");
+	char *x = sf_hpin(h[2]);
+	cr_assert_eq(x, at[0], "Object was not moved to the lowest hole (exp=%p, found=%p)", at[0], x);
+	cr_assert(x[0] == 'c' && x[199] == 'c', "Object was not copied!");
+	sf_hunpin(h[2]);
+	cr_assert_eq(sf_hpin(h[5]), pinned, "A pinned object moved!");
+	sf_hunpin(h[5]);
+	assert_free_block_count(0, 2);
+
+	sf_hunpin(h[5]);
+	cr_assert_eq(sf_hcompact(0), 240, "Wrong number of bytes moved!");
+	x = sf_hpin(h[5]);
+	cr_assert(x == at[3] && x[0] == 'f', "Unpinned object was not moved!");
+	sf_hunpin(h[5]);
+	assert_free_block_count(0, 1);
+	cr_assert_eq(sf_hcompact(0), 0, "A compacted heap was moved again!");
+
+	for (int i = 2; i < 6; i++)
+		sf_hfree(h[i]);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+static __attribute__((noinline)) void *lifetime_auto_site(size_t size) {
+	void *p = sf_malloc_hint(size, SF_AUTO_LIVED);
+	// Not a tail call, which would make each caller of this function a site of its own
+	__asm__ volatile ("" ::: "memory");
+	return p;
+}
+
+Test(sfmm_student_suite, lifetime_hints_segregate_and_trim, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	char *s = sf_malloc_hint(100, SF_SHORT_LIVED);
+	char *l = sf_malloc_hint(100, SF_LONG_LIVED);
+	char *d = sf_malloc(100);
+	cr_assert(s != NULL && l != NULL && d != NULL, "Allocation failed!");
+	// Each lifetime has a segment of its own
+	cr_assert(l - s > 2 * PAGE_SZ && d - l > 2 * PAGE_SZ, "Lifetimes share a segment!");
+
+	// Until its objects are seen dying young, a call site counts as long-lived
+	char *a = lifetime_auto_site(100);
+	cr_assert(a > l && a < d, "Unknown site was not long-lived!");
+	sf_free(a);
+	for (int i = 0; i < 100; i++)
+		sf_free(lifetime_auto_site(100));
+	a = lifetime_auto_site(100);
+	cr_assert(a < l, "Short-lived site was not detected!");
+	sf_free(a);
+
+	// The emptied short-lived segment goes back to the default heap
+	sf_free(s);
+	assert_free_block_count(0, 1);
+	cr_assert(sf_trim() > 0, "Nothing was trimmed!");
+	assert_free_block_count(0, 2);
+	char *x = sf_malloc(3 * PAGE_SZ);
+	cr_assert(x < s && x + 3 * PAGE_SZ > s, "Segment was not reused (s=%p, found=%p)", s, x);
+
+	cr_assert_null(sf_malloc_hint(100, SF_SHORT_LIVED | SF_LONG_LIVED), "Bad hint was accepted!");
+	cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
+}
+
+Test(sfmm_student_suite, lifetime_heaps_read_conf, .timeout = TEST_TIMEOUT) {
+	// sf_malloc_hint is the first call, so it has to read SFMM_CONF itself
+	setenv("SFMM_CONF", "colors=4,color_min=512", 1);
+	sf_errno = 0;
+	char *p[3];
+	for (int i = 0; i < 3; i++)
+		p[i] = sf_malloc_hint(SZ(1000), SF_SHORT_LIVED);
+
+	cr_assert(p[0] != NULL && p[1] != NULL && p[2] != NULL, "Allocation failed!");
+	cr_assert_eq(p[1], p[0] + 1024 + 64, "Wrong color (exp=%p, found=%p)", p[0] + 1024 + 64, p[1]);
+	cr_assert_eq(p[2], p[1] + 1024 + 128, "Wrong color (exp=%p, found=%p)", p[1] + 1024 + 128, p[2]);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, malloc_near_uses_neighbors, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	char *q = sf_malloc(50);
+	char *h = sf_malloc(SZ(500));
+	char *n = sf_malloc(SZ(500));
+	sf_malloc(3 * PAGE_SZ);
+	char *far = sf_malloc(50);
+	sf_malloc(10);
+
+	// A quick-list block on the hint's page is preferred over the head of the list
+	sf_free(q);
+	sf_free(far);
+	char *x = sf_malloc_near(h, 50);
+	cr_assert_eq(x, q, "Nearby quick block was not used (exp=%p, found=%p)", q, x);
+
+	// The front of the free block after the hint, then the back of the one before it
+	sf_free(n);
+	x = sf_malloc_near(h, SZ(200));
+	cr_assert_eq(x, n, "Next block was not used (exp=%p, found=%p)", n, x);
+	char *y = sf_malloc_near(x, SZ(200));
+	cr_assert_eq(y, x + 224, "Rest of next block was not used (exp=%p, found=%p)", x + 224, y);
+	sf_free(h);
+	char *z = sf_malloc_near(x, SZ(200));
+	cr_assert_eq(z, x - 224, "Back of previous block was not used (exp=%p, found=%p)", x - 224, z);
+	assert_free_block_count(528 - 224, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, heap_dump_records_blocks, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	char *a = sf_malloc(SZ(100));
+	char *b = sf_malloc(50);
+	char *c = sf_malloc(SZ(500));
+	sf_malloc(10);
+	sf_free(b);
+	sf_free(c);
+
+	FILE *f = tmpfile();
+	cr_assert_eq(sf_heap_dump(fileno(f)), 0, "Dump failed!");
+	rewind(f);
+	sf_dump_header h;
+	cr_assert_eq(fread(&h, sizeof(h), 1, f), 1, "Header is missing!");
+	cr_assert(memcmp(h.magic, SF_DUMP_MAGIC, sizeof(h.magic)) == 0, "Bad magic!");
+	cr_assert_eq(h.heap_start, (uintptr_t)sf_mem_start(), "Wrong heap start!");
+	cr_assert_eq(h.blocks, 5, "Wrong number of blocks (exp=5, found=%lu)", (unsigned long)h.blocks);
+
+	// The records tile the heap from the prologue to the epilogue
+	static const int states[] = { SF_DUMP_ALLOCATED, SF_DUMP_QUICK, SF_DUMP_FREE, SF_DUMP_ALLOCATED, SF_DUMP_TOP };
+	uint64_t offset = 40;
+	for (int i = 0; i < 5; i++) {
+		sf_dump_record r;
+		cr_assert_eq(fread(&r, sizeof(r), 1, f), 1, "Record %d is missing!", i);
+		cr_assert_eq(r.offset, offset, "Record %d is at the wrong offset!", i);
+		cr_assert_eq(r.state, states[i], "Record %d has state %d!", i, r.state);
+		offset += r.size;
+		if (i == 0) {
+			cr_assert(r.offset == a - 8 - (char *)sf_mem_start() && r.size == 128 && r.payload == SZ(100),
+				  "Wrong allocated record!");
+		}
+	}
+	cr_assert_eq(offset, (char *)sf_mem_end() - (char *)sf_mem_start() - 8, "Records do not reach the epilogue!");
+	fclose(f);
+
+	cr_assert_eq(sf_heap_dump(-1), -1, "Dump to a bad descriptor succeeded!");
+	cr_assert(sf_errno == EBADF, "sf_errno is not EBADF!");
+}
+
+Test(sfmm_student_suite, private_heap_free_routes_to_owner, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_heap_t *heap = sf_heap_create();
+	cr_assert_not_null(heap, "heap is NULL!");
+
+	int *x = sf_heap_malloc(heap, sizeof(int));
+	int *y = sf_malloc(sizeof(int));
+	cr_assert_not_null(x, "x is NULL!");
+	*x = 4;
+	*y = 5;
+
+	// A small private block goes to the quick list of its own heap
+	sf_free(x);
+	assert_quick_list_block_count(0, 0);
+	sf_free(y);
+	assert_quick_list_block_count(32, 1);
+
+	sf_heap_destroy(heap);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, private_heap_destroy_releases_blocks, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_heap_t *heap = sf_heap_create();
+	void *blocks[32];
+	for (int i = 0; i < 32; i++) {
+		blocks[i] = sf_heap_malloc(heap, 100 + 37 * i);
+		cr_assert_not_null(blocks[i], "Block %d is NULL!", i);
+		memset(blocks[i], i, 100 + 37 * i);
+	}
+	char *big = sf_heap_malloc(heap, 2 * PAGE_SZ);
+	cr_assert_not_null(big, "big is NULL!");
+	big = sf_heap_realloc(heap, big, 5 * PAGE_SZ);
+	cr_assert_not_null(big, "big is NULL after realloc!");
+
+	// Nothing is freed block by block; destroy hands every segment back at once
+	sf_heap_destroy(heap);
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 2);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, region_reset_and_destroy, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_region_t *region = sf_region_create(NULL);
+	cr_assert_not_null(region, "region is NULL!");
+
+	// Objects are packed back to back without headers
+	char *a = sf_region_alloc(region, 40);
+	char *b = sf_region_alloc(region, 8);
+	cr_assert(((uintptr_t)a & 15) == 0, "Object %p is not 16-byte aligned!", a);
+	cr_assert_eq(b, a + 48, "Objects are not contiguous (a=%p, b=%p)", a, b);
+
+	// Spill into further chunks, then rewind to the first one
+	for (int i = 0; i < 100; i++)
+		cr_assert_not_null(sf_region_alloc(region, 500), "Allocation %d failed!", i);
+	sf_region_reset(region);
+	cr_assert_eq(sf_region_alloc(region, 40), a, "Reset did not rewind the region!");
+
+	// All chunks coalesce back into the single free block of the heap
+	sf_region_destroy(region);
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, pool_packs_and_releases_chunks, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_pool_t *pool = sf_pool_create(40, 8);
+	cr_assert_not_null(pool, "pool is NULL!");
+
+	// 40-byte objects are packed 40 bytes apart instead of in 64-byte blocks
+	char *a = sf_pool_alloc(pool);
+	char *b = sf_pool_alloc(pool);
+	cr_assert_eq(b, a + 40, "Objects are not packed (a=%p, b=%p)", a, b);
+
+	sf_pool_stats_t stats;
+	void *objs[1000];
+	for (int i = 0; i < 1000; i++)
+		objs[i] = sf_pool_alloc(pool);
+	sf_pool_stats(pool, &stats);
+	cr_assert_eq(stats.in_use, 1002, "Wrong number of objects in use (exp=%d, found=%ld)",
+		     1002, stats.in_use);
+	cr_assert(stats.chunks == 3, "Wrong number of chunks (exp=%d, found=%ld)", 3, stats.chunks);
+
+	// Freed objects are reused first
+	sf_pool_free(pool, b);
+	cr_assert_eq(sf_pool_alloc(pool), b, "Freed object was not reused!");
+
+	// Emptied chunks go back to the heap; trimming releases the ones still held
+	for (int i = 0; i < 1000; i++)
+		sf_pool_free(pool, objs[i]);
+	sf_pool_free(pool, a);
+	sf_pool_free(pool, b);
+	sf_pool_stats(pool, &stats);
+	cr_assert_eq(stats.in_use, 0, "Objects still in use!");
+	cr_assert(stats.chunks <= 2, "Empty chunks were not released (found=%ld)", stats.chunks);
+	sf_pool_trim(pool);
+	sf_pool_stats(pool, &stats);
+	cr_assert(stats.chunks == 0, "Wrong number of chunks (exp=%d, found=%ld)", 0, stats.chunks);
+
+	sf_pool_destroy(pool);
+	assert_quick_list_block_count(0, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, pool_invalid_alignment, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	sf_pool_t *pool = sf_pool_create(40, 24);
+
+	cr_assert_null(pool, "pool is not NULL!");
+	cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
+}
+
+Test(sfmm_student_suite, deferred_coalesce_on_miss, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *x[10];
+	for (int i = 0; i < 10; i++)
+		x[i] = sf_malloc(16);
+
+	// Small frees are never coalesced, even past QUICK_LIST_MAX
+	for (int i = 0; i < 10; i++)
+		sf_free(x[i]);
+	assert_quick_list_block_count(32, 10);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(3728, 1);
+
+	// A request that misses merges them back instead of growing the heap
+	void *y = sf_malloc(SZ(3800));
+	cr_assert_not_null(y, "y is NULL!");
+	assert_quick_list_block_count(0, 0);
+	assert_free_block_count(0, 1);
+	assert_free_block_count(224, 1);
+	cr_assert_eq((char *)sf_mem_end() - (char *)sf_mem_start(), PAGE_SZ,
+		     "Heap grew although consolidation was enough!");
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, wilderness_carved_and_extended, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	// 5000 + 16 (overhead) rounds up to a 5024 byte block, which needs a second page
+	char *x = sf_malloc(SZ(5000));
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert_eq((char *)sf_mem_end() - (char *)sf_mem_start(), 2 * PAGE_SZ,
+		     "Heap is not two pages!");
+
+	// The page extended the top chunk, and the block was cut off its front
+	sf_block *top = sf_free_list_heads[NUM_FREE_LISTS - 1].body.links.prev;
+	cr_assert_eq((char *)top, x - 8 + 5024, "Top chunk does not follow the block!");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(8144 - 5024, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, placement_best_fit, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *a = sf_malloc(400);
+	sf_malloc(10);
+	void *c = sf_malloc(300);
+	sf_malloc(10);
+
+	// First fit would take a, which was freed last and heads the list
+	sf_free(c);
+	sf_free(a);
+	cr_assert_eq(sf_heap_set_placement(NULL, SF_BEST_FIT, 0), 0, "Setting best fit failed!");
+	void *x = sf_malloc(300);
+	cr_assert_eq(x, c, "Best fit did not pick the smallest block (exp=%p, found=%p)", c, x);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, placement_address_ordered, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	void *a = sf_malloc(300);
+	sf_malloc(10);
+	void *c = sf_malloc(300);
+	sf_malloc(10);
+	void *d = sf_malloc(300);
+	sf_malloc(10);
+
+	// Switching the policy sorts the blocks that are already free
+	sf_free(a);
+	sf_free(d);
+	sf_free(c);
+	cr_assert_eq(sf_heap_set_placement(NULL, SF_ADDRESS_FIT, 0), 0, "Setting address order failed!");
+	void *x = sf_malloc(300);
+	cr_assert_eq(x, a, "Lowest block was not used (exp=%p, found=%p)", a, x);
+	sf_free(x);
+	x = sf_malloc(300);
+	cr_assert_eq(x, a, "Lowest block was not used after free (exp=%p, found=%p)", a, x);
+
+	cr_assert_eq(sf_heap_set_placement(NULL, 7, 0), -1, "Unknown policy was accepted!");
+	cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
+}
+
+Test(sfmm_student_suite, coloring_offsets_large_blocks, .timeout = TEST_TIMEOUT) {
+	sf_errno = 0;
+	cr_assert_eq(sf_heap_set_coloring(NULL, 4, SZ(1000)), 0, "Setting coloring failed!");
+	char *p[4];
+	for (int i = 0; i < 4; i++)
+		p[i] = sf_malloc(SZ(1000));
+
+	// Each 1024-byte block starts one more cache line after the previous one
+	cr_assert_eq(p[1], p[0] + 1024 + 64, "Wrong color (exp=%p, found=%p)", p[0] + 1024 + 64, p[1]);
+	cr_assert_eq(p[3], p[2] + 1024 + 192, "Wrong color (exp=%p, found=%p)", p[2] + 1024 + 192, p[3]);
+	assert_free_block_count(64, 1);
+	assert_free_block_count(128, 1);
+	assert_free_block_count(192, 1);
+
+	// The skipped lines merge back with the blocks
+	for (int i = 0; i < 4; i++)
+		sf_free(p[i]);
+	assert_free_block_count(0, 1);
+
+	cr_assert_eq(sf_heap_set_coloring(NULL, 65, 0), -1, "Too many colors were accepted!");
+	cr_assert(sf_errno == EINVAL, "sf_errno is not EINVAL!");
+}
+
+Test(sfmm_student_suite, conf_quick_max_flushes, .timeout = TEST_TIMEOUT) {
+	// Read once, at the first allocation
+	setenv("SFMM_CONF", "quick_max=5", 1);
+	sf_errno = 0;
+	void *x[6];
+	for (int i = 0; i < 6; i++)
+		x[i] = sf_malloc(16);
+	for (int i = 0; i < 6; i++)
+		sf_free(x[i]);
+
+	// The sixth free flushed the first five, which coalesced into one block
+	assert_quick_list_block_count(0, 1);
+	assert_quick_list_block_count(32, 1);
+	assert_free_block_count(0, 2);
+	assert_free_block_count(160, 1);
+	assert_free_block_count(3856, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, conf_grow_pages, .timeout = TEST_TIMEOUT) {
+	setenv("SFMM_CONF", "grow_pages=4,bogus=1,quick_lists=x", 1);
+	sf_errno = 0;
+	void *x = sf_malloc(SZ(5000));
+
+	cr_assert_not_null(x, "x is NULL!");
+	cr_assert_eq((char *)sf_mem_end() - (char *)sf_mem_start(), 5 * PAGE_SZ,
+		     "Heap did not grow by four pages at once!");
+	assert_free_block_count(0, 1);
+	assert_free_block_count(5 * PAGE_SZ - 48 - 5024, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
+
+Test(sfmm_student_suite, conf_intermediate_classes, .timeout = TEST_TIMEOUT) {
+	// Classes 32, 48, 64, 96, 128, 192, 256, 384, ...: a 304-byte block lands in list 7
+	setenv("SFMM_CONF", "class_steps=2", 1);
+	sf_errno = 0;
+	void *x = sf_malloc(288);
+	void *y = sf_malloc(8);
+
+	cr_assert_not_null(y, "y is NULL!");
+	sf_free(x);
+	sf_block *head = &sf_free_list_heads[7];
+	cr_assert(head->body.links.next != head, "List 7 is empty!");
+	cr_assert_eq((head->body.links.next->header ^ sf_magic()) & ~0xffffffff0000000f, 304,
+		     "Wrong block in list 7!");
+	assert_free_block_count(304, 1);
+	cr_assert(sf_errno == 0, "sf_errno is not zero!");
+}
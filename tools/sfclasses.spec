@@ -0,0 +1,16 @@
+# Free-list size classes, compiled into build/gen/sfclasses.h by
+# tools/sfclasses_gen.c.  Pick another spec with `make CLASS_SPEC=<file>`.
+#
+# The first class holds blocks up to `min` bytes.  Each further class bound is
+# `growth` times the one `steps` classes before it, with `steps - 1` evenly
+# spaced intermediate bounds in between, rounded up to the 16-byte block grid.
+# The last free list holds every block above the last bound.  Block sizes up
+# to `table_limit` are looked up in a table; larger ones scan the bounds.
+#
+# The default is the original layout: 32, 64, 128, ... 32768, then the rest.
+# `steps 2` gives 32, 48, 64, 96, 128, 192, ... 1024 instead.
+
+min 32
+growth 2
+steps 1
+table_limit 65536
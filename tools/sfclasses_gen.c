@@ -0,0 +1,123 @@
+/**
+ * Generates the free-list size-class tables from a size-class spec.
+ *
+ * Usage: sfclasses_gen <spec> > sfclasses.h
+ *
+ * The spec (see tools/sfclasses.spec) is a list of "key value" lines.  The
+ * generated header defines the class bounds and a table that maps every block
+ * size up to the table limit, in 16-byte steps, to its free list, so that
+ * sfmm.c finds the list of a block with a single load.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfmm.h"
+
+#define GRID 16
+
+static const struct {
+    const char *key;
+    long min, max;
+} keys[] = {
+    { "min", 32, 65536 },
+    { "growth", 2, 16 },
+    { "steps", 1, 8 },
+    { "table_limit", 256, 1 << 20 },
+};
+#define NUM_KEYS (sizeof(keys) / sizeof(keys[0]))
+
+static long values[NUM_KEYS] = { 32, 2, 1, 65536 };
+enum { MIN, GROWTH, STEPS, TABLE_LIMIT };
+
+static int parse_spec(FILE *in, const char *name) {
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), in) != NULL){
+        lineno++;
+        char key[64];
+        long value;
+        char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0'){
+            continue;
+        }
+        if (sscanf(p, "%63s %ld", key, &value) != 2){
+            fprintf(stderr, "%s:%d: expected \"key value\"\n", name, lineno);
+            return -1;
+        }
+        size_t k = 0;
+        while (k < NUM_KEYS && strcmp(key, keys[k].key) != 0){
+            k++;
+        }
+        if (k == NUM_KEYS){
+            fprintf(stderr, "%s:%d: unknown key %s\n", name, lineno, key);
+            return -1;
+        }
+        if (value < keys[k].min || value > keys[k].max || (k != GROWTH && k != STEPS && value % GRID != 0)){
+            fprintf(stderr, "%s:%d: %s out of range\n", name, lineno, key);
+            return -1;
+        }
+        values[k] = value;
+    }
+    if (values[TABLE_LIMIT] < values[MIN]){
+        fprintf(stderr, "%s: table_limit is below min\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2){
+        fprintf(stderr, "usage: %s <spec>\n", argv[0]);
+        return 2;
+    }
+    FILE *in = fopen(argv[1], "r");
+    if (in == NULL){
+        perror(argv[1]);
+        return 1;
+    }
+    int err = parse_spec(in, argv[1]);
+    fclose(in);
+    if (err){
+        return 1;
+    }
+
+    // Same construction as build_class_bounds() in sfmm.c
+    unsigned long long bounds[NUM_FREE_LISTS - 1];
+    unsigned long long base = values[MIN];
+    int count = 0;
+    while (count < NUM_FREE_LISTS - 1){
+        for (long step = 0; step < values[STEPS] && count < NUM_FREE_LISTS - 1; step++){
+            unsigned long long bound = base + base * (values[GROWTH] - 1) * step / values[STEPS];
+            bound = (bound + GRID - 1) & ~(unsigned long long)(GRID - 1);
+            if (count == 0 || bound > bounds[count - 1]){
+                bounds[count++] = bound;
+            }
+        }
+        base *= values[GROWTH];
+    }
+
+    printf("/* Generated by tools/sfclasses_gen.c from %s; do not edit. */\n", argv[1]);
+    printf("#ifndef SFCLASSES_H\n#define SFCLASSES_H\n\n");
+    printf("#define SF_CLASS_MIN %ld\n", values[MIN]);
+    printf("#define SF_CLASS_GROWTH %ld\n", values[GROWTH]);
+    printf("#define SF_CLASS_STEPS %ld\n", values[STEPS]);
+    printf("#define SF_CLASS_TABLE_LIMIT %ld\n\n", values[TABLE_LIMIT]);
+
+    printf("#define SF_CLASS_BOUNDS { \\\n   ");
+    for (int i = 0; i < NUM_FREE_LISTS - 1; i++){
+        printf(" %llu,", bounds[i]);
+    }
+    printf(" (size_t)-1 }\n\n");
+
+    // One entry per 16 bytes: entry i is the list of block size i * 16
+    printf("#define SF_CLASS_TABLE { \\\n");
+    int index = 0;
+    for (long i = 0; i <= values[TABLE_LIMIT] / GRID; i++){
+        while (index < NUM_FREE_LISTS - 1 && (unsigned long long)i * GRID > bounds[index]){
+            index++;
+        }
+        printf("%s%d,%s", i % 32 == 0 ? "    " : " ", index, i % 32 == 31 ? " \\\n" : "");
+    }
+    printf(" }\n\n#endif\n");
+    return 0;
+}
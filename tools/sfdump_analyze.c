@@ -0,0 +1,219 @@
+/**
+ * Summarizes a heap snapshot written by sf_heap_dump.
+ *
+ * Usage: sfdump_analyze [-p] <snapshot>
+ *
+ * Reports the blocks by state, the distribution of free block sizes in
+ * power-of-two buckets, the largest contiguous free span, how full the heap's
+ * pages are and how much sf_trim could give back.  Quick-list blocks and the
+ * top chunk count as free: sf_trim merges the quick lists before it releases
+ * the pages inside free blocks.  With -p the occupancy of every page is listed
+ * too.  The snapshot is read in one pass, so "-" reads it from a pipe.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "sfdump.h"
+
+#define BUCKETS 33
+#define OCCUPANCY_BANDS 6
+
+typedef struct report {
+    uint64_t count[4], bytes[4];        // By state
+    uint64_t payload;
+    uint64_t bucket_count[BUCKETS], bucket_bytes[BUCKETS];
+    uint64_t largest_span, largest_span_offset;
+    uint64_t trimmable;
+    uint64_t *page_used;                // Bytes of allocated blocks in each page
+    uint64_t pages;
+} report;
+
+static const char *state_names[4] = { "free", "allocated", "quick", "top" };
+
+static int is_free(int state) {
+    return state != SF_DUMP_ALLOCATED;
+}
+
+static int bucket_of(uint64_t size) {
+    int b = 0;
+    while (b < BUCKETS - 1 && (2ULL << b) <= size) {
+        b++;
+    }
+    return b;
+}
+
+/**
+ * Adds the bytes [start, end) of an allocated block to the pages they cover.
+ */
+static void add_used(report *r, uint64_t page_size, uint64_t start, uint64_t end) {
+    while (start < end) {
+        uint64_t page = start / page_size;
+        uint64_t stop = (page + 1) * page_size < end ? (page + 1) * page_size : end;
+        if (page < r->pages) {
+            r->page_used[page] += stop - start;
+        }
+        start = stop;
+    }
+}
+
+/**
+ * Accounts for a run of adjacent free blocks as sf_trim would see it once merged: the
+ * whole pages past the free block's header and links, and before its footer.
+ */
+static void end_span(report *r, const sf_dump_header *h, uint64_t start, uint64_t end) {
+    if (end - start > r->largest_span) {
+        r->largest_span = end - start;
+        r->largest_span_offset = start;
+    }
+    uint64_t addr = h->heap_start + start;
+    uint64_t first = (addr + 24 + h->page_size - 1) / h->page_size * h->page_size;
+    uint64_t last = (h->heap_start + end - 8) / h->page_size * h->page_size;
+    if (last > first) {
+        r->trimmable += last - first;
+    }
+}
+
+static int read_snapshot(FILE *in, sf_dump_header *h, report *r) {
+    if (fread(h, sizeof(*h), 1, in) != 1 || memcmp(h->magic, SF_DUMP_MAGIC, sizeof(h->magic)) != 0) {
+        fprintf(stderr, "not a heap snapshot\n");
+        return -1;
+    }
+    if (h->version != SF_DUMP_VERSION || h->record_size != sizeof(sf_dump_record) || h->page_size == 0) {
+        fprintf(stderr, "unsupported snapshot version %u\n", h->version);
+        return -1;
+    }
+    r->pages = (h->heap_size + h->page_size - 1) / h->page_size;
+    r->page_used = calloc(r->pages ? r->pages : 1, sizeof(uint64_t));
+    if (r->page_used == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    uint64_t span_start = 0, span_end = 0;
+    int in_span = 0;
+    sf_dump_record rec;
+    for (uint64_t i = 0; i < h->blocks; i++) {
+        if (fread(&rec, sizeof(rec), 1, in) != 1) {
+            fprintf(stderr, "snapshot truncated after %llu of %llu blocks\n",
+                    (unsigned long long)i, (unsigned long long)h->blocks);
+            return -1;
+        }
+        int state = rec.state < 4 ? rec.state : SF_DUMP_ALLOCATED;
+        r->count[state]++;
+        r->bytes[state] += rec.size;
+        if (!is_free(state)) {
+            r->payload += rec.payload;
+            add_used(r, h->page_size, rec.offset, rec.offset + rec.size);
+            if (in_span) {
+                end_span(r, h, span_start, span_end);
+                in_span = 0;
+            }
+            continue;
+        }
+        int b = bucket_of(rec.size);
+        r->bucket_count[b]++;
+        r->bucket_bytes[b] += rec.size;
+        if (!in_span || rec.offset != span_end) {
+            if (in_span) {
+                end_span(r, h, span_start, span_end);
+            }
+            span_start = rec.offset;
+            in_span = 1;
+        }
+        span_end = rec.offset + rec.size;
+    }
+    if (in_span) {
+        end_span(r, h, span_start, span_end);
+    }
+    return 0;
+}
+
+static void print_report(const sf_dump_header *h, const report *r, int per_page) {
+    uint64_t blocks = 0, free_bytes = 0;
+    for (int s = 0; s < 4; s++) {
+        blocks += r->count[s];
+        free_bytes += is_free(s) ? r->bytes[s] : 0;
+    }
+    printf("heap: %llu bytes at 0x%llx, %llu pages of %llu bytes, %llu blocks\n",
+           (unsigned long long)h->heap_size, (unsigned long long)h->heap_start,
+           (unsigned long long)r->pages, (unsigned long long)h->page_size, (unsigned long long)blocks);
+    printf("\n%-10s %12s %16s\n", "state", "blocks", "bytes");
+    for (int s = 0; s < 4; s++) {
+        printf("%-10s %12llu %16llu\n", state_names[s], (unsigned long long)r->count[s],
+               (unsigned long long)r->bytes[s]);
+    }
+    if (r->bytes[SF_DUMP_ALLOCATED] > 0) {
+        printf("payload %llu bytes, %.1f%% of the allocated blocks\n", (unsigned long long)r->payload,
+               100.0 * r->payload / r->bytes[SF_DUMP_ALLOCATED]);
+    }
+
+    printf("\nfree block sizes\n%-22s %12s %16s %8s\n", "size", "blocks", "bytes", "% free");
+    for (int b = 0; b < BUCKETS; b++) {
+        if (r->bucket_count[b] == 0) {
+            continue;
+        }
+        char range[32];
+        snprintf(range, sizeof(range), "%llu - %llu", 1ULL << b, (2ULL << b) - 1);
+        printf("%-22s %12llu %16llu %7.1f%%\n", range, (unsigned long long)r->bucket_count[b],
+               (unsigned long long)r->bucket_bytes[b], 100.0 * r->bucket_bytes[b] / free_bytes);
+    }
+    printf("largest contiguous free span: %llu bytes at offset %llu\n",
+           (unsigned long long)r->largest_span, (unsigned long long)r->largest_span_offset);
+
+    // Pages by the share of their bytes that belong to allocated blocks
+    static const char *bands[OCCUPANCY_BANDS] = { "empty", "< 25%", "25 - 50%", "50 - 75%", "75 - 99%", "full" };
+    uint64_t band_pages[OCCUPANCY_BANDS] = { 0 };
+    for (uint64_t p = 0; p < r->pages; p++) {
+        uint64_t used = r->page_used[p];
+        int band = used == 0 ? 0 : used >= h->page_size ? 5 : 1 + (int)(4 * used / h->page_size);
+        band_pages[band]++;
+    }
+    printf("\npage occupancy\n%-10s %12s\n", "in use", "pages");
+    for (int b = 0; b < OCCUPANCY_BANDS; b++) {
+        printf("%-10s %12llu\n", bands[b], (unsigned long long)band_pages[b]);
+    }
+    printf("trimmable: %llu bytes (%llu pages) inside free blocks\n",
+           (unsigned long long)r->trimmable, (unsigned long long)(r->trimmable / h->page_size));
+
+    if (per_page) {
+        printf("\n%-12s %12s\n", "page offset", "bytes in use");
+        for (uint64_t p = 0; p < r->pages; p++) {
+            printf("%-12llu %12llu\n", (unsigned long long)(p * h->page_size),
+                   (unsigned long long)r->page_used[p]);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int per_page = 0, opt;
+    while ((opt = getopt(argc, argv, "ph")) != -1) {
+        switch (opt) {
+        case 'p': per_page = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-p] <snapshot>\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-p] <snapshot>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    FILE *in = strcmp(argv[optind], "-") == 0 ? stdin : fopen(argv[optind], "rb");
+    if (in == NULL) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    sf_dump_header h;
+    report r;
+    memset(&r, 0, sizeof(r));
+    if (read_snapshot(in, &h, &r) != 0) {
+        return EXIT_FAILURE;
+    }
+    print_report(&h, &r, per_page);
+    free(r.page_used);
+    return EXIT_SUCCESS;
+}